@@ -0,0 +1,122 @@
+#include "clone_log.h"
+#include "query.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ================================= Local variables ================================
+
+static bool log_enabled = false;
+static double wall_start = 0;
+
+// Entries of this PE, in the order they happened
+static struct CloneLogEntry *entries = NULL;
+static size_t num_entries = 0;
+static size_t entries_capacity = 0;
+
+static bool has_directions(enum CLONE_EVENT event) {
+    return event != CLONE_EVENT_root && event != CLONE_EVENT_unpooled
+        && event != CLONE_EVENT_suspended && event != CLONE_EVENT_resumed;
+}
+
+bool is_valid_CloneLogEntry(struct CloneLogEntry const *entry) {
+    return entry->branch != BRANCH_NONE
+        && (entry->event == CLONE_EVENT_suspended || entry->event == CLONE_EVENT_resumed
+            || (entry->parent == BRANCH_NONE) == (entry->event == CLONE_EVENT_root))
+        && entry->query >= 0 && entry->query < g_num_queries
+        && is_valid_position(entry->x, entry->y)
+        && (!has_directions(entry->event)
+            || (entry->first_dir < DIRECTION_none && entry->second_dir < DIRECTION_none))
+        && entry->wall_time >= 0;
+}
+
+void assert_valid_CloneLogEntry(struct CloneLogEntry const *entry) {
+#ifndef NDEBUG
+    assert(entry->branch != BRANCH_NONE);
+    assert(entry->event == CLONE_EVENT_suspended || entry->event == CLONE_EVENT_resumed
+           || (entry->parent == BRANCH_NONE) == (entry->event == CLONE_EVENT_root));
+    assert(entry->query >= 0 && entry->query < g_num_queries);
+    assert(is_valid_position(entry->x, entry->y));
+    assert(!has_directions(entry->event)
+           || (entry->first_dir < DIRECTION_none && entry->second_dir < DIRECTION_none));
+    assert(entry->wall_time >= 0);
+#endif
+}
+
+// ================================= Recording ================================
+
+void clone_log_init(bool enabled) {
+    log_enabled = enabled;
+    wall_start = MPI_Wtime();
+}
+
+bool clone_log_enabled(void) {
+    return log_enabled;
+}
+
+void clone_log_record(struct CloneLogEntry entry) {
+    if (!log_enabled) {
+        return;
+    }
+    entry.wall_time = MPI_Wtime() - wall_start;
+    assert_valid_CloneLogEntry(&entry);
+
+    if (num_entries == entries_capacity) {
+        size_t const new_capacity = entries_capacity ? 2 * entries_capacity : 256;
+        struct CloneLogEntry *grown = realloc(entries, new_capacity * sizeof(*entries));
+        if (!grown) {
+            tw_error(TW_LOC, "Failed to allocate %zu clone log entries", new_capacity);
+        }
+        entries = grown;
+        entries_capacity = new_capacity;
+    }
+    entries[num_entries++] = entry;
+}
+
+// ================================= Output ================================
+
+static char const *const event_names[] = {"root", "cloned", "pooled", "dropped", "unpooled", "spilled",
+                                                 "suspended", "resumed"};
+static char const direction_letters[] = "NSEW-";
+
+// Longest line an entry can take
+#define MAX_LINE_SIZE 256
+
+int clone_log_write(MPI_Comm comm) {
+    char *text = malloc(num_entries * MAX_LINE_SIZE + 1);
+    if (!text) {
+        tw_error(TW_LOC, "Failed to allocate the text of %zu clone log entries", num_entries);
+    }
+
+    // Formatting only happens here, so recording stays cheap
+    size_t size = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        struct CloneLogEntry const *entry = &entries[i];
+        size += sprintf(text + size, "%" PRIu64 ",", entry->branch);
+        if (entry->parent != BRANCH_NONE) {
+            size += sprintf(text + size, "%" PRIu64, entry->parent);
+        }
+        size += sprintf(text + size, ",%s,%d,%d,%d,%c,%c,%.9g,%.9g,%.6f,%d\n",
+                        event_names[entry->event], entry->query, entry->x, entry->y,
+                        direction_letters[entry->first_dir], direction_letters[entry->second_dir],
+                        entry->sim_time, entry->gvt, entry->wall_time, entry->pe);
+    }
+
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    int const status = write_rank_ordered_file(comm, "search-clones.csv",
+        "branch,parent,event,query,x,y,first_dir,second_dir,sim_time,gvt,wall_time,pe\n", text, size, NULL);
+    if (status == 0 && rank == 0) {
+        printf("Clone log written to search-clones.csv\n");
+    }
+    free(text);
+    return status;
+}
+
+void clone_log_free(void) {
+    free(entries);
+    entries = NULL;
+    num_entries = 0;
+    entries_capacity = 0;
+}
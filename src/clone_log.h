@@ -0,0 +1,82 @@
+#ifndef SEARCH_CLONE_LOG_H
+#define SEARCH_CLONE_LOG_H
+
+/** @file
+ * Genealogy of the branches: what happened to every branch created while
+ * searching, to rebuild the tree of branches after the run.
+ *
+ * Every branch has an id, unique within the run. A query starts a root
+ * branch. A decision creates a new branch (the second direction) whose parent
+ * is the branch that took the decision, which goes on with the first
+ * direction. Entries are kept in memory by the first member of every group and
+ * written to `search-clones.csv` at the end of the run.
+ */
+
+#include "state.h"
+#include <mpi.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Id of no branch (the parent of root branches) */
+#define BRANCH_NONE UINT64_MAX
+
+/** What happened to a branch */
+enum CLONE_EVENT {
+  CLONE_EVENT_root = 0,   /**< A query started */
+  CLONE_EVENT_cloned,     /**< The branch was created and sent to an empty group */
+  CLONE_EVENT_pooled,     /**< The branch was created and stored in the pool of its parent's group */
+  CLONE_EVENT_dropped,    /**< The branch was created but the pool was full, it never ran */
+  CLONE_EVENT_unpooled,   /**< The branch left a pool and started running */
+  CLONE_EVENT_spilled,    /**< The branch was created but the pool was full, it was written to disk */
+  CLONE_EVENT_suspended,  /**< The branch was still running when the run ended, it was written to disk */
+  CLONE_EVENT_resumed     /**< A suspended branch started running again */
+};
+
+/** An entry of the log. Invariants:
+ * - branch != BRANCH_NONE
+ * - parent == BRANCH_NONE if and only if event == CLONE_EVENT_root, except for
+ *   suspended and resumed events, which keep the parent of the branch (none for a root)
+ * - 0 <= query < g_num_queries
+ * - (x,y) lies inside the grid (the start for root branches, the decision cell
+ *   otherwise, which for suspended and resumed events is the one the branch was born at)
+ * - first_dir and second_dir are directions other than DIRECTION_none, except
+ *   for root, unpooled, suspended and resumed events
+ * - wall_time >= 0
+ */
+struct CloneLogEntry {
+  uint64_t branch;
+  uint64_t parent;
+  enum CLONE_EVENT event;
+  int query;
+  int x, y;
+  enum DIRECTION first_dir;   /**< Direction the parent went on with */
+  enum DIRECTION second_dir;  /**< Direction of the branch */
+  double sim_time;            /**< Simulation time of the decision (or start) */
+  double gvt;                 /**< GVT when the event happened */
+  double wall_time;           /**< Seconds since `clone_log_init` when the event happened */
+  int pe;                     /**< First PE of the group running (or holding) the branch, -1 if dropped */
+};
+
+bool is_valid_CloneLogEntry(struct CloneLogEntry const *entry);
+
+void assert_valid_CloneLogEntry(struct CloneLogEntry const *entry);
+
+/** Starts the log (entries are only kept if `enabled`), and the clock of its
+ * wall times. */
+void clone_log_init(bool enabled);
+
+/** Whether entries are kept. */
+bool clone_log_enabled(void);
+
+/** Adds `entry` to the entries of this PE (a no-op if the log is off). Sets
+ * the wall time of the entry. */
+void clone_log_record(struct CloneLogEntry entry);
+
+/** Writes the entries of all PEs to `search-clones.csv`, one line per entry.
+ * Returns 0 on success. Collective. */
+int clone_log_write(MPI_Comm comm);
+
+/** Frees the entries. */
+void clone_log_free(void);
+
+#endif /* SEARCH_CLONE_LOG_H */
@@ -1,7 +1,31 @@
 #include "director.h"
+#include "clone_log.h"
+#include "hook_stats.h"
 #include "ross-extern.h"
 #include "state.h"
+#include "driver.h"
+#include "mapping.h"
+#include "query.h"
+#include "utils.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Maximum number of bytes sent in a single message when cloning. Bigger
+ * transfers (dirty LP states of very large grids) are split into chunks of this size.
+ * It must fit in an `int`, as that is what MPI takes as count. */
+#define CLONE_CHUNK_SIZE (1 << 22)
+
+/** Alignment of every transfer within a shared segment */
+#define SHARED_ALIGNMENT 64
+
+/** Maximum number of alternative branches a PE keeps around when there is no
+ * empty PE to clone to. They are handed to PEs as they become free. */
+#define BRANCH_POOL_CAPACITY 16
 
 static inline void synch_lp_to_gvt(tw_pe *pe, tw_lp *grid_lp, tw_event_sig *gvt_sig) {
     grid_lp->kp->last_sig = *gvt_sig;
@@ -16,6 +40,7 @@ struct DecisionInfo {
     enum DIRECTION chosen_dir;   /**< First direction chosen */
     enum DIRECTION second_dir;   /**< Second direction option */
     tw_stime timestamp;          /**< When the decision was made */
+    struct AgentTrail trail;     /**< Trail the agent brought to the position (when carrying visited cells) */
 };
 
 static inline void assert_valid_DecisionInfo(struct DecisionInfo *di) {
@@ -34,6 +59,7 @@ enum OPTION {
     OPTION_second_branch
 };
 
+// All ranks of a clone group share the same state, as they simulate the same branch
 enum PE_STATE {
     PE_EMPTY = 0,           // No simulation running
     PE_BUSY = 1,            // Simulation running, no trigger
@@ -47,6 +73,68 @@ static bool did_this_pe_trigger = false;
 // PE state tracking for dynamic allocation
 static enum PE_STATE my_pe_state = PE_EMPTY;
 
+// Set (on commit) when the agent of the branch running on this PE stops
+static bool branch_finished = false;
+static tw_stime branch_finished_at = -1;
+
+// First query not started yet (query 0 starts on group 0). The same on all PEs
+static int next_query = 1;
+
+// Id of the branch running on this group (BRANCH_NONE if empty), and number
+// of ids this group has handed out. The same on all members of the group
+static uint64_t current_branch = BRANCH_NONE;
+static uint32_t num_branch_ids = 0;
+
+// Parent of the branch running on this group, and the decision it was born
+// from (the start cell with no directions for a root), so that a branch
+// saved while running is logged and resumed as the same branch
+static uint64_t current_parent = BRANCH_NONE;
+static struct DecisionInfo current_origin;
+
+// Stop all PEs as soon as one of them finds the goal (set by `director_config`)
+static bool g_stop_on_first_goal = false;
+
+// Whether the agent reached the goal on this PE (kept in sync on rollback)
+static bool goal_reached = false;
+
+// Contiguous buffer used to pack/unpack dirty LP states when cloning (reused between clones)
+static char *state_buffer = NULL;
+static size_t state_buffer_size = 0;
+
+// Communicator used for all clone transfers, duplicated from MPI_COMM_ROSS so
+// that cloning messages never collide with ROSS's own messages
+static MPI_Comm clone_comm = MPI_COMM_NULL;
+
+// Ranks of the clone group of this rank, ordered by member
+static MPI_Comm group_comm = MPI_COMM_NULL;
+
+// Empty groups are found through an MPI window instead of an allgather (set
+// by `director_config`, see "One-sided allocation" below)
+static bool g_one_sided_allocation = false;
+static void allocation_window_init(int num_busy_groups);
+
+// Clones between ranks of the same node go through shared memory: every rank
+// of the node has a segment of `shared_segment_size` bytes (0 turns it off)
+// where it copies the branches it sends, and the destination reads them from
+// there. `node_rank_of[r]` is the rank in `node_comm` of rank r of
+// `clone_comm` (MPI_UNDEFINED if on another node). `shared_used` bytes of the
+// own segment hold transfers of the last hook, which destinations acknowledge
+// once read (see `post_branch_send`)
+static size_t shared_segment_size = 0;
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static MPI_Win shared_win = MPI_WIN_NULL;
+static char **shared_segments = NULL;
+static int *node_rank_of = NULL;
+static size_t shared_used = 0;
+
+// Branches that do not fit in the pool are written to `spill_dir` (NULL to
+// drop them), and a run with `resume_dir` starts from the branches found
+// there instead of the queries (see `struct SpillFileHeader` below)
+static char const *spill_dir = NULL;
+static char const *resume_dir = NULL;
+static void create_spill_dir(void);
+static int resume_branches(void);
+
 // Generates a non-valid current decision position, because current_decision should never be used if did_this_pe_trigger == false
 static void clean_current_decision(void) {
     current_decision.x = -1;
@@ -54,16 +142,183 @@ static void clean_current_decision(void) {
     current_decision.chosen_dir = DIRECTION_none;
     current_decision.second_dir = DIRECTION_none;
     current_decision.timestamp = -1;
+    current_decision.trail = (struct AgentTrail) {0, 0, 0};
 
     did_this_pe_trigger = false;
 }
 
+// Ids are unique within the run: the first PE of the group in the upper half,
+// a count of the ids handed out by the group in the lower one
+static uint64_t new_branch_id(void) {
+    uint64_t const leader = (uint64_t) search_my_group() * g_tiling.group_size;
+    return leader << 32 | num_branch_ids++;
+}
+
+// Logs what happened to `branch`, a child of `parent` (a root if BRANCH_NONE)
+// born from the current decision, or from `current_origin` when suspending or
+// resuming the running branch. Only the first member of the group logs
+static void log_branch(enum CLONE_EVENT event, uint64_t branch, uint64_t parent, tw_stime gvt, int pe) {
+    if (!clone_log_enabled() || search_my_member() != 0) {
+        return;
+    }
+    struct CloneLogEntry entry = {
+        .branch = branch,
+        .parent = parent,
+        .event = event,
+        .query = g_current_query,
+        .x = current_decision.x,
+        .y = current_decision.y,
+        .first_dir = current_decision.chosen_dir,
+        .second_dir = current_decision.second_dir,
+        .sim_time = current_decision.timestamp,
+        .gvt = gvt,
+        .pe = pe,
+    };
+    if (event == CLONE_EVENT_root) {
+        entry.x = g_start_x;
+        entry.y = g_start_y;
+        entry.first_dir = entry.second_dir = DIRECTION_none;
+        entry.sim_time = gvt;
+    } else if (event == CLONE_EVENT_unpooled) {
+        entry.first_dir = entry.second_dir = DIRECTION_none;
+    } else if (event == CLONE_EVENT_suspended || event == CLONE_EVENT_resumed) {
+        entry.x = current_origin.x;
+        entry.y = current_origin.y;
+        entry.first_dir = entry.second_dir = DIRECTION_none;
+        entry.sim_time = current_origin.timestamp;
+    }
+    clone_log_record(entry);
+}
+
+// The branch running on this group is a root of the current query
+static void set_root_origin(tw_stime gvt) {
+    current_parent = BRANCH_NONE;
+    current_origin = (struct DecisionInfo) {
+        .x = g_start_x,
+        .y = g_start_y,
+        .chosen_dir = DIRECTION_none,
+        .second_dir = DIRECTION_none,
+        .timestamp = gvt,
+    };
+}
+
+void director_config(bool stop_on_first_goal, bool one_sided_allocation, size_t shared_segment_bytes,
+                     char const *spill_directory, char const *resume_directory) {
+    g_stop_on_first_goal = stop_on_first_goal;
+    g_one_sided_allocation = one_sided_allocation;
+    shared_segment_size = shared_segment_bytes;
+    resume_dir = resume_directory;
+    // Resumed branches that do not get to run go back where they came from
+    spill_dir = spill_directory ? spill_directory : resume_directory;
+}
+
+bool director_is_resuming(void) {
+    return resume_dir != NULL;
+}
+
+// Finds the ranks on the same node and maps their segments. Nodes with a
+// single rank have no use for them
+static void shared_transport_init(void) {
+    if (shared_segment_size == 0) {
+        return;
+    }
+    MPI_Comm_split_type(clone_comm, MPI_COMM_TYPE_SHARED, (int) g_tw_mynode, MPI_INFO_NULL, &node_comm);
+    int node_size;
+    MPI_Comm_size(node_comm, &node_size);
+    if (node_size == 1) {
+        MPI_Comm_free(&node_comm);
+        return;
+    }
+
+    int const world_size = tw_nnodes();
+    int *ranks = malloc(world_size * sizeof(*ranks));
+    node_rank_of = malloc(world_size * sizeof(*node_rank_of));
+    shared_segments = malloc(node_size * sizeof(*shared_segments));
+    if (!ranks || !node_rank_of || !shared_segments) {
+        tw_error(TW_LOC, "Failed to allocate the map of the ranks of the node");
+    }
+    for (int rank = 0; rank < world_size; rank++) {
+        ranks[rank] = rank;
+    }
+    MPI_Group clone_group, node_group;
+    MPI_Comm_group(clone_comm, &clone_group);
+    MPI_Comm_group(node_comm, &node_group);
+    MPI_Group_translate_ranks(clone_group, world_size, ranks, node_group, node_rank_of);
+    MPI_Group_free(&clone_group);
+    MPI_Group_free(&node_group);
+    free(ranks);
+
+    char *my_segment;
+    MPI_Win_allocate_shared(shared_segment_size, 1, MPI_INFO_NULL, node_comm, &my_segment, &shared_win);
+    for (int rank = 0; rank < node_size; rank++) {
+        MPI_Aint size;
+        int disp_unit;
+        void *base;
+        MPI_Win_shared_query(shared_win, rank, &size, &disp_unit, &base);
+        shared_segments[rank] = base;
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, shared_win);
+}
+
+static void shared_transport_free(void) {
+    if (shared_win != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(shared_win);
+        MPI_Win_free(&shared_win);
+    }
+    if (node_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&node_comm);
+    }
+    free(shared_segments);
+    free(node_rank_of);
+    shared_segments = NULL;
+    node_rank_of = NULL;
+}
+
 void director_init(void) {
     clean_current_decision();
-    // PE 0 starts busy (running simulation), others start empty
-    my_pe_state = (g_tw_mynode == 0) ? PE_BUSY : PE_EMPTY;
+    MPI_Comm_dup(MPI_COMM_ROSS, &clone_comm);
+    MPI_Comm_split(clone_comm, search_my_group(), search_my_member(), &group_comm);
+    if (search_mapping_num_local_lps() > UINT32_MAX) {
+        tw_error(TW_LOC, "PE %d has %llu LPs, more than clones can address", (int) g_tw_mynode,
+                 (unsigned long long) search_mapping_num_local_lps());
+    }
+    if (spill_dir) {
+        create_spill_dir();
+    }
+
+    int num_busy_groups;
+    if (resume_dir) {
+        // No query starts from scratch. Groups with resumed branches in their
+        // pool start them on the first GVT hook, the others start empty
+        int const num_groups = tw_nnodes() / g_tiling.group_size;
+        int const num_resumed = resume_branches();
+        num_busy_groups = num_resumed < num_groups ? num_resumed : num_groups;
+        next_query = g_num_queries;
+        my_pe_state = PE_EMPTY;
+        if (g_tw_mynode == 0) {
+            printf("Resuming %d branches from %s\n", num_resumed, resume_dir);
+        }
+    } else {
+        // Group 0 starts busy (running simulation), others start empty
+        num_busy_groups = 1;
+        my_pe_state = (search_my_group() == 0) ? PE_BUSY : PE_EMPTY;
+        if (my_pe_state == PE_BUSY) {
+            current_branch = new_branch_id();
+            set_root_origin(0);
+            log_branch(CLONE_EVENT_root, current_branch, BRANCH_NONE, 0, (int) g_tw_mynode);
+        }
+    }
+    if (g_one_sided_allocation) {
+        allocation_window_init(num_busy_groups);
+    }
+    shared_transport_init();
 }
 
+/** A pending event, as sent when cloning. Branches move between groups (and
+ * between runs), so LP ids are relative: `local_lpid` to the first LP of the
+ * rank, `msg.sender` to the first LP of the group. Like events themselves,
+ * they leave the trail out unless the agent carries visited cells, so buffers
+ * hold one every `serializable_event_size()` bytes (see `serializable_event_at`) */
 struct SerializableEvent {
     tw_lpid local_lpid;
     tw_stime recv_ts;
@@ -71,124 +326,886 @@ struct SerializableEvent {
     struct SearchMessage msg;
 };
 
-// BUG: We are not copying the tie-breaker signature for each event, which means that tied events will be pontentially rescheduled at the destination on a different order to that of the source simulation. Copying the precise tie-breaker signature is not a solution, because we don't want TWO different events with the same precise signature (leads to weird collisions and conflicts with the assumptions of cloning, where only ONE PE calls the director at the time)
-static void clone_events(tw_pe *pe, tw_peid source, tw_peid dest) {
-    assert(g_tw_mynode == source || g_tw_mynode == dest);
+static size_t serializable_event_size(void) {
+    return offsetof(struct SerializableEvent, msg) + search_message_size();
+}
 
-    if (g_tw_mynode == source) {
-        tw_event_sig gvt_sig = pe->GVT_sig;
+static struct SerializableEvent *serializable_event_at(struct SerializableEvent *events, int i) {
+    return (struct SerializableEvent *) ((char *) events + (size_t) i * serializable_event_size());
+}
 
-        int event_count = 0;
-        struct SerializableEvent *events = NULL;
+static struct SerializableEvent const *serializable_event_at_const(struct SerializableEvent const *events, int i) {
+    return (struct SerializableEvent const *) ((char const *) events + (size_t) i * serializable_event_size());
+}
 
-        tw_event *next_event = tw_pq_dequeue(pe->pq);
-        tw_event *dequeued_events = NULL;
+/** State of a single modified (dirty) LP, as sent when cloning. Local ids
+ * fit in 32 bits (checked by `director_init`), which keeps a delta at 8 bytes */
+struct CellDelta {
+    uint32_t local_lpid;
+    struct SearchCellState state;
+};
 
-        while (next_event) {
-            assert(tw_event_sig_compare_ptr(&next_event->sig, &gvt_sig) >= 0);
+/** First message of every clone transfer. It tells the destination what the
+ * decision to take is, which branch it is, which query the branch answers and
+ * how much data follows it, either as messages (tagged with
+ * `CLONE_TAG_states` and `CLONE_TAG_events`) or in the shared segment of the
+ * source. A branch saved while it was running (see `director_spill_pending`)
+ * has no decision to take, it goes on from its pending events, and `decision`
+ * only tells where it was born. Invariants:
+ * - unless running, `decision` is a valid decision and parent is not BRANCH_NONE
+ * - if running, the cell of `decision` lies inside the grid
+ * - branch is not BRANCH_NONE
+ * - 0 <= query < g_num_queries
+ * - num_dirty >= 0 and num_events >= 0
+ * - shared_offset >= -1
+ * - gvt >= 0
+ */
+struct CloneHeader {
+    struct DecisionInfo decision;
+    uint64_t branch;
+    uint64_t parent;  /**< Branch that took the decision */
+    int query;
+    int num_dirty;   /**< Number of `struct CellDelta` that follow */
+    int num_events;  /**< Number of `struct SerializableEvent` that follow */
+    int64_t shared_offset;  /**< Where states (then events) start in the shared segment of the source, -1 if sent as messages */
+    tw_stime gvt;           /**< GVT at the time the states and events were snapshotted */
+    bool running;           /**< Whether the branch was running when snapshotted (with no decision to take) */
+};
 
-            if (next_event->event_id && next_event->state.remote) {
-                tw_hash_remove(pe->hash_t, next_event, next_event->send_pe);
-            }
+static inline bool is_valid_CloneHeader(struct CloneHeader *header) {
+    return header->branch != BRANCH_NONE && (header->running || header->parent != BRANCH_NONE)
+        && (!header->running || is_valid_position(header->decision.x, header->decision.y))
+        && header->query >= 0 && header->query < g_num_queries
+        && header->num_dirty >= 0 && header->num_events >= 0
+        && header->shared_offset >= -1
+        && header->gvt >= 0;
+}
+
+static inline void assert_valid_CloneHeader(struct CloneHeader *header) {
+#ifndef NDEBUG
+    if (!header->running) {
+        assert_valid_DecisionInfo(&header->decision);
+        assert(header->parent != BRANCH_NONE);
+    } else {
+        assert(is_valid_position(header->decision.x, header->decision.y));
+    }
+    assert(header->branch != BRANCH_NONE);
+    assert(header->query >= 0 && header->query < g_num_queries);
+    assert(header->num_dirty >= 0);
+    assert(header->num_events >= 0);
+    assert(header->shared_offset >= -1);
+    assert(header->gvt >= 0);
+#endif
+}
+
+/** MPI tags used by clone transfers (on `clone_comm`) */
+enum CLONE_TAG {
+    CLONE_TAG_header = 1,
+    CLONE_TAG_states,
+    CLONE_TAG_events,
+    CLONE_TAG_ack,   /**< Empty message, the destination is done reading a branch from a shared segment */
+    CLONE_TAG_assign /**< What a group claimed with one-sided allocation is going to receive */
+};
+
+// Buffer of serialized pending events (reused between clones)
+static struct SerializableEvent *event_buffer = NULL;
+static size_t event_buffer_capacity = 0;
+
+/** A branch that has not been started yet: the decision to take plus a
+ * compact snapshot of the dirty LP states and pending events at the time the
+ * decision was made (at GVT `header.gvt`). The agent draws random numbers
+ * from the stream of the LP it moves on, which is then dirty, so the streams
+ * of the dirty LPs are kept too, to start the branch where it left off when
+ * it is started on this group. Invariants:
+ * - `header` is a valid header
+ * - `cells` and `rngs` hold `header.num_dirty` deltas and streams (the stream
+ *   of the LP of each delta), `events` holds `header.num_events` events
+ */
+struct BranchSnapshot {
+    struct CloneHeader header;
+    struct CellDelta *cells;
+    tw_rng_stream *rngs;
+    struct SerializableEvent *events;
+};
+
+static inline bool is_valid_BranchSnapshot(struct BranchSnapshot *snapshot) {
+    return is_valid_CloneHeader(&snapshot->header) &&
+           (snapshot->header.num_dirty == 0 || (snapshot->cells != NULL && snapshot->rngs != NULL)) &&
+           (snapshot->header.num_events == 0 || snapshot->events != NULL);
+}
+
+static inline void assert_valid_BranchSnapshot(struct BranchSnapshot *snapshot) {
+#ifndef NDEBUG
+    assert_valid_CloneHeader(&snapshot->header);
+    assert(snapshot->header.num_dirty == 0 || (snapshot->cells != NULL && snapshot->rngs != NULL));
+    assert(snapshot->header.num_events == 0 || snapshot->events != NULL);
+#endif
+}
+
+// Branches waiting for an empty PE, oldest first
+static struct BranchSnapshot branch_pool[BRANCH_POOL_CAPACITY];
+static int branch_pool_size = 0;
+
+// Outgoing (non-blocking) transfers posted during the last GVT hook. The
+// buffers they point to (`state_buffer`, `event_buffer`, `outgoing_header`
+// and the snapshots in `in_flight_branches`) cannot be touched until all of
+// their requests are completed
+static struct CloneHeader outgoing_header;
+static struct BranchSnapshot in_flight_branches[BRANCH_POOL_CAPACITY];
+static int num_in_flight_branches = 0;
+static MPI_Request *outgoing_requests = NULL;
+static int num_outgoing_requests = 0;
+static int outgoing_requests_capacity = 0;
+
+// Makes sure that `event_buffer` can hold at least `count` events
+static void reserve_event_buffer(size_t count) {
+    if (count <= event_buffer_capacity) {
+        return;
+    }
+    event_buffer = realloc(event_buffer, count * serializable_event_size());
+    if (!event_buffer) {
+        tw_error(TW_LOC, "Failed to allocate %zu events for cloning", count);
+    }
+    event_buffer_capacity = count;
+}
+
+// Makes sure that `state_buffer` can hold at least `size` bytes
+static void reserve_state_buffer(size_t size) {
+    if (size <= state_buffer_size) {
+        return;
+    }
+    state_buffer = realloc(state_buffer, size);
+    if (!state_buffer) {
+        tw_error(TW_LOC, "Failed to allocate %zu bytes for cloning LP states", size);
+    }
+    state_buffer_size = size;
+}
 
-            events = realloc(events, (event_count + 1) * sizeof(struct SerializableEvent));
-            events[event_count].local_lpid = next_event->dest_lpid - g_tw_lp_offset;
-            events[event_count].recv_ts = next_event->recv_ts;
-            events[event_count].prio = next_event->sig.priority;
+// Makes sure there is space for `count` more outgoing requests
+static void reserve_outgoing_requests(int count) {
+    if (num_outgoing_requests + count <= outgoing_requests_capacity) {
+        return;
+    }
+    outgoing_requests_capacity = num_outgoing_requests + count;
+    outgoing_requests = realloc(outgoing_requests, outgoing_requests_capacity * sizeof(MPI_Request));
+    if (!outgoing_requests) {
+        tw_error(TW_LOC, "Failed to allocate %d MPI requests for cloning", outgoing_requests_capacity);
+    }
+}
 
-            void *msg_data = tw_event_data(next_event);
-            events[event_count].msg = *(struct SearchMessage*)msg_data;
+static void free_BranchSnapshot(struct BranchSnapshot *snapshot) {
+    free(snapshot->cells);
+    free(snapshot->rngs);
+    free(snapshot->events);
+    snapshot->cells = NULL;
+    snapshot->rngs = NULL;
+    snapshot->events = NULL;
+}
 
-            event_count++;
+// Waits for the transfers posted in the previous hook (if any) to be fully
+// sent. They are usually completed long before, as destinations receive
+// them right away
+static void complete_outgoing_transfers(void) {
+    MPI_Waitall(num_outgoing_requests, outgoing_requests, MPI_STATUSES_IGNORE);
+    num_outgoing_requests = 0;
+    shared_used = 0;
 
-            next_event->prev = dequeued_events;
-            dequeued_events = next_event;
-            next_event = tw_pq_dequeue(pe->pq);
+    for (int i = 0; i < num_in_flight_branches; i++) {
+        free_BranchSnapshot(&in_flight_branches[i]);
+    }
+    num_in_flight_branches = 0;
+}
+
+static int num_chunks_for(size_t size) {
+    return (size + CLONE_CHUNK_SIZE - 1) / CLONE_CHUNK_SIZE;
+}
+
+// Posts the non-blocking send (or receive) of `size` bytes in chunks of at
+// most CLONE_CHUNK_SIZE bytes, storing the requests in `requests` (which must
+// have space for `num_chunks_for(size)` requests)
+static void post_chunked(bool sending, void *buffer, size_t size, int peer, enum CLONE_TAG tag, MPI_Request *requests) {
+    int const num_chunks = num_chunks_for(size);
+    for (int i = 0; i < num_chunks; i++) {
+        size_t const offset = (size_t) i * CLONE_CHUNK_SIZE;
+        int const chunk_size = size - offset < CLONE_CHUNK_SIZE ? size - offset : CLONE_CHUNK_SIZE;
+
+        if (sending) {
+            MPI_Isend((char *) buffer + offset, chunk_size, MPI_BYTE, peer, tag, clone_comm, &requests[i]);
+        } else {
+            MPI_Irecv((char *) buffer + offset, chunk_size, MPI_BYTE, peer, tag, clone_comm, &requests[i]);
         }
+    }
+}
+
+// BUG: We are not copying the tie-breaker signature for each event, which means that tied events will be pontentially rescheduled at the destination on a different order to that of the source simulation. Copying the precise tie-breaker signature is not a solution, because we don't want TWO different events with the same precise signature (leads to weird collisions and conflicts with the assumptions of cloning, where only ONE PE calls the director at the time)
+// Serializes every pending event of the PE into `buffer` (which must hold
+// `tw_pq_get_size(pe->pq)` events) in one linear pass, and returns how many there are.
+// The ROSS priority queue offers no read-only iterator, so each event is
+// dequeued and put back right away; the event itself (and its entry in the
+// remote-events hash table) is never modified
+static int snapshot_pending_events(tw_pe *pe, struct SerializableEvent *buffer) {
+    tw_event_sig gvt_sig = pe->GVT_sig;
+    int const event_count = tw_pq_get_size(pe->pq);
+
+    tw_event *dequeued_events = NULL;
+    for (int i = 0; i < event_count; i++) {
+        tw_event *next_event = tw_pq_dequeue(pe->pq);
+        assert(next_event);
+        assert(tw_event_sig_compare_ptr(&next_event->sig, &gvt_sig) >= 0);
+
+        struct SerializableEvent *serial = serializable_event_at(buffer, i);
+        serial->local_lpid = next_event->dest_lpid - g_tw_lp_offset;
+        serial->recv_ts = next_event->recv_ts;
+        serial->prio = next_event->sig.priority;
+        memcpy(&serial->msg, tw_event_data(next_event), search_message_size());
+        assert(serial->msg.sender >= g_tiling.group_lp_offset);
+        serial->msg.sender -= g_tiling.group_lp_offset;
+
+        next_event->prev = dequeued_events;
+        dequeued_events = next_event;
+    }
+
+    while (dequeued_events) {
+        tw_event *prev_event = dequeued_events;
+        dequeued_events = dequeued_events->prev;
+        prev_event->prev = NULL;
+        tw_pq_enqueue(pe->pq, prev_event);
+    }
+
+    return event_count;
+}
+
+// Schedules the serialized events on the local LPs, `shift` later than they
+// were snapshotted
+static void install_events(tw_pe *pe, struct SerializableEvent const *events, int event_count, tw_stime shift) {
+    tw_event_sig gvt_sig = pe->GVT_sig;
+    tw_stime gvt = gvt_sig.recv_ts;
 
-        while (dequeued_events) {
-            tw_event *prev_event = dequeued_events;
-            dequeued_events = dequeued_events->prev;
-            prev_event->prev = NULL;
-            tw_pq_enqueue(pe->pq, prev_event);
+    for (int i = 0; i < event_count; i++) {
+        struct SerializableEvent const *serial = serializable_event_at_const(events, i);
+        tw_lpid local_lpid = serial->local_lpid;
+        if (local_lpid < g_tw_nlp) {
+            tw_lp *dest_lp = g_tw_lp[local_lpid];
+            synch_lp_to_gvt(pe, dest_lp, &gvt_sig);
 
-            if (prev_event->event_id && prev_event->state.remote) {
-                tw_hash_insert(pe->hash_t, prev_event, prev_event->send_pe);
+            // Scheduling event from itself
+            tw_event *new_event = tw_event_new_user_prio(dest_lp->gid, serial->recv_ts + shift - gvt,
+                                                           dest_lp, serial->prio);
+            struct SearchMessage *msg = (struct SearchMessage*)tw_event_data(new_event);
+            memcpy(msg, &serial->msg, search_message_size());
+            msg->sender += g_tiling.group_lp_offset;
+
+            tw_event_send(new_event);
+        }
+    }
+}
+
+// Packs the state of all dirty LPs into `buffer` (which must hold
+// `search_lp_num_dirty()` deltas), returning how many were packed. Only cells modified
+// since initialization are sent, the destination rebuilds the rest from
+// `g_obstacle_plane`
+static int pack_dirty_lp_states(struct CellDelta *buffer) {
+    int num_dirty = 0;
+    for (size_t page = 0; page < search_lp_num_pages(); page++) {
+        if (!search_lp_page_is_dirty(page)) continue;
+        for (tw_lpid local_lpid = page * LP_PAGE_SIZE; local_lpid < search_lp_page_end(page); local_lpid++) {
+            struct SearchCellState const *state = g_tw_lp[local_lpid]->cur_state;
+            if (is_dirty_SearchCellState(state)) {
+                buffer[num_dirty].local_lpid = (uint32_t) local_lpid;
+                buffer[num_dirty].state = *state;
+                num_dirty++;
             }
         }
+    }
+    return num_dirty;
+}
 
-        MPI_Send(&event_count, 1, MPI_INT, dest, 0, MPI_COMM_ROSS);
-        if (event_count > 0) {
-            MPI_Send(events, event_count * sizeof(struct SerializableEvent),
-                     MPI_BYTE, dest, 0, MPI_COMM_ROSS);
+// Returns every dirty LP to its initial state. Clean LPs are already there
+static void reset_dirty_lp_states(void) {
+    for (size_t page = 0; page < search_lp_num_pages(); page++) {
+        if (!search_lp_page_is_dirty(page)) continue;
+        for (tw_lpid local_lpid = page * LP_PAGE_SIZE; local_lpid < search_lp_page_end(page); local_lpid++) {
+            tw_lp *lp = g_tw_lp[local_lpid];
+            if (is_dirty_SearchCellState(lp->cur_state)) {
+                search_lp_reset_state(lp->cur_state, lp);
+            }
         }
-        free(events);
+    }
+}
 
-    } else if (g_tw_mynode == dest) {
-        tw_event_sig gvt_sig = pe->GVT_sig;
-        tw_stime gvt = gvt_sig.recv_ts;
+static void unpack_dirty_lp_states(struct CellDelta const *buffer, int num_dirty) {
+    reset_dirty_lp_states();
+    for (int i = 0; i < num_dirty; i++) {
+        assert(buffer[i].local_lpid < g_tw_nlp);
+        tw_lp *lp = g_tw_lp[buffer[i].local_lpid];
+        search_lp_restore_state(lp->cur_state, lp, &buffer[i].state);
+    }
+}
+
+// Copies the RNG stream of the LP of every delta into a new array
+static tw_rng_stream *pack_lp_rngs(struct CellDelta const *cells, int num_dirty) {
+    tw_rng_stream *rngs = malloc((num_dirty > 0 ? num_dirty : 1) * sizeof(tw_rng_stream));
+    if (!rngs) {
+        tw_error(TW_LOC, "Failed to allocate the RNG streams of %d LPs", num_dirty);
+    }
+    for (int i = 0; i < num_dirty; i++) {
+        rngs[i] = *g_tw_lp[cells[i].local_lpid]->rng;
+    }
+    return rngs;
+}
 
-        int event_count;
-        MPI_Status status;
+static void unpack_lp_rngs(struct CellDelta const *cells, tw_rng_stream const *rngs, int num_dirty) {
+    for (int i = 0; i < num_dirty; i++) {
+        assert(cells[i].local_lpid < g_tw_nlp);
+        *g_tw_lp[cells[i].local_lpid]->rng = rngs[i];
+    }
+}
 
-        MPI_Recv(&event_count, 1, MPI_INT, source, 0, MPI_COMM_ROSS, &status);
+// Posts the non-blocking send of a branch (header, dirty LP states and
+// pending events) to `dest`. The buffers must stay untouched until
+// `complete_outgoing_transfers` is called
+static void post_branch_send(struct CloneHeader *header, struct CellDelta *cells,
+                             struct SerializableEvent *events, tw_peid dest) {
+    size_t const states_size = header->num_dirty * sizeof(struct CellDelta);
+    size_t const events_size = header->num_events * serializable_event_size();
 
-        if (event_count > 0) {
-            struct SerializableEvent *events = malloc(event_count * sizeof(struct SerializableEvent));
-            MPI_Recv(events, event_count * sizeof(struct SerializableEvent),
-                     MPI_BYTE, source, 0, MPI_COMM_ROSS, &status);
+    // Destinations on the same node read the branch straight from the
+    // segment of this rank, only the header goes as a message. The header
+    // message orders the copy before the reads, and the destination
+    // acknowledges once it is done reading, so that the space is not reused
+    // before (it may only receive the branch in a later hook)
+    size_t const offset = (shared_used + SHARED_ALIGNMENT - 1) / SHARED_ALIGNMENT * SHARED_ALIGNMENT;
+    header->shared_offset = -1;
+    if (shared_win != MPI_WIN_NULL && node_rank_of[dest] != MPI_UNDEFINED
+        && offset + states_size + events_size <= shared_segment_size) {
+        char *segment = shared_segments[node_rank_of[g_tw_mynode]] + offset;
+        memcpy(segment, cells, states_size);
+        memcpy(segment + states_size, events, events_size);
+        MPI_Win_sync(shared_win);
+        shared_used = offset + states_size + events_size;
+        header->shared_offset = (int64_t) offset;
+        assert_valid_CloneHeader(header);
 
-            for (int i = 0; i < event_count; i++) {
-                tw_lpid local_lpid = events[i].local_lpid;
-                if (local_lpid >= 0 && local_lpid < g_tw_nlp) {
-                    tw_lp *dest_lp = g_tw_lp[local_lpid];
-                    synch_lp_to_gvt(pe, dest_lp, &gvt_sig);
+        reserve_outgoing_requests(2);
+        MPI_Isend(header, sizeof(struct CloneHeader), MPI_BYTE, dest,
+                  CLONE_TAG_header, clone_comm, &outgoing_requests[num_outgoing_requests++]);
+        MPI_Irecv(NULL, 0, MPI_BYTE, dest, CLONE_TAG_ack, clone_comm, &outgoing_requests[num_outgoing_requests++]);
+        return;
+    }
+    assert_valid_CloneHeader(header);
 
-                    // Scheduling event from itself
-                    tw_event *new_event = tw_event_new_user_prio(dest_lp->gid, events[i].recv_ts - gvt, dest_lp, events[i].prio);
-                    struct SearchMessage *msg = (struct SearchMessage*)tw_event_data(new_event);
-                    *msg = events[i].msg;
+    int const num_state_chunks = num_chunks_for(states_size);
+    int const num_requests = 1 + num_state_chunks + num_chunks_for(events_size);
+    reserve_outgoing_requests(num_requests);
 
-                    tw_event_send(new_event);
-                }
-            }
-            free(events);
+    MPI_Request *requests = &outgoing_requests[num_outgoing_requests];
+    MPI_Isend(header, sizeof(struct CloneHeader), MPI_BYTE, dest,
+              CLONE_TAG_header, clone_comm, &requests[0]);
+    post_chunked(true, cells, states_size, dest, CLONE_TAG_states, &requests[1]);
+    post_chunked(true, events, events_size, dest, CLONE_TAG_events, &requests[1 + num_state_chunks]);
+    num_outgoing_requests += num_requests;
+}
+
+// Source side of a clone. The transfer is only posted here, the PE goes back
+// to simulating while the messages are in flight. Every member of a group
+// sends its own tile to the same member of the destination group, so local
+// LP ids mean the same cell on both sides
+static void send_clone(tw_pe *pe, tw_peid dest, uint64_t branch) {
+    assert(search_mapping_num_local_lps() == g_tw_nlp);
+    double began = hook_stats_begin();
+    reserve_state_buffer(search_lp_num_dirty() * sizeof(struct CellDelta));
+    outgoing_header.decision = current_decision;
+    outgoing_header.branch = branch;
+    outgoing_header.parent = current_branch;
+    outgoing_header.query = g_current_query;
+    outgoing_header.num_dirty = pack_dirty_lp_states((struct CellDelta *) state_buffer);
+    double const pack_seconds = hook_stats_end(HOOK_PHASE_pack_states, began);
+
+    began = hook_stats_begin();
+    reserve_event_buffer(tw_pq_get_size(pe->pq));
+    outgoing_header.num_events = snapshot_pending_events(pe, event_buffer);
+    outgoing_header.gvt = pe->GVT_sig.recv_ts;
+    outgoing_header.running = false;
+    double const snapshot_seconds = hook_stats_end(HOOK_PHASE_snapshot_events, began);
+
+    began = hook_stats_begin();
+    post_branch_send(&outgoing_header, (struct CellDelta *) state_buffer, event_buffer, dest);
+
+    double const seconds = hook_stats_end(HOOK_PHASE_send, began);
+    hook_stats_transfer(BRANCH_TRANSFER_clone_sent, (int) dest,
+                        outgoing_header.num_dirty, outgoing_header.num_dirty * sizeof(struct CellDelta),
+                        outgoing_header.num_events, outgoing_header.num_events * serializable_event_size(),
+                        pack_seconds, snapshot_seconds, pack_seconds + snapshot_seconds + seconds,
+                        pe->GVT_sig.recv_ts);
+}
+
+// With a spill directory, branches that do not fit in the pool are written to
+// disk instead of being dropped, and read back into the pool as it empties.
+// At the end of the run, the pools and the branches still running go there too.
+// Every member of a group writes its own tile of the branch to
+// `<dir>/branch-<id>.m<member>.bin`, so the directory can be on the local
+// scratch of every node. The files hold raw structs and local LP ids: they
+// are only good for a run of the same build, with the same grid, group size,
+// queries and carrying of visited cells
+
+/** Magic at the start of every spill file, to be changed with the format */
+#define SPILL_MAGIC "SRCHBR05"
+
+/** What comes before the cells, the RNG streams of their LPs and the events
+ * in a spill file. Invariants:
+ * - magic is SPILL_MAGIC
+ * - group_size, member, grid size, number of free cells, tiles, first LP of
+ *   the member, num_local_lps and event_size are those of this rank
+ * - `header` is a valid header, with shared_offset == -1
+ * - header.num_dirty <= num_local_lps
+ */
+struct SpillFileHeader {
+    char magic[8];
+    int32_t group_size;
+    int32_t member;
+    int32_t grid_width, grid_height;
+    int32_t tiles_x, tiles_y;
+    uint64_t num_free_cells;
+    uint64_t member_lp_base;  /**< First LP of the member within the group */
+    uint64_t num_local_lps;
+    uint64_t event_size;      /**< `serializable_event_size()`, which depends on carrying visited cells */
+    struct CloneHeader header;
+};
+
+static inline bool is_valid_SpillFileHeader(struct SpillFileHeader *file) {
+    return memcmp(file->magic, SPILL_MAGIC, sizeof(file->magic)) == 0
+        && file->group_size == g_tiling.group_size && file->member == search_my_member()
+        && file->grid_width == g_grid_width && file->grid_height == g_grid_height
+        && file->tiles_x == g_tiling.tiles_x && file->tiles_y == g_tiling.tiles_y
+        && file->num_free_cells == g_num_free_cells
+        && file->member_lp_base == g_tiling.lp_base[search_my_member()]
+        && file->num_local_lps == search_mapping_num_local_lps()
+        && file->event_size == serializable_event_size()
+        && is_valid_CloneHeader(&file->header) && file->header.shared_offset == -1
+        && (uint64_t) file->header.num_dirty <= file->num_local_lps;
+}
+
+static inline void assert_valid_SpillFileHeader(struct SpillFileHeader *file) {
+#ifndef NDEBUG
+    assert(memcmp(file->magic, SPILL_MAGIC, sizeof(file->magic)) == 0);
+    assert(file->group_size == g_tiling.group_size && file->member == search_my_member());
+    assert(file->grid_width == g_grid_width && file->grid_height == g_grid_height);
+    assert(file->tiles_x == g_tiling.tiles_x && file->tiles_y == g_tiling.tiles_y);
+    assert(file->num_free_cells == g_num_free_cells);
+    assert(file->member_lp_base == g_tiling.lp_base[search_my_member()]);
+    assert(file->num_local_lps == search_mapping_num_local_lps());
+    assert(file->event_size == serializable_event_size());
+    assert_valid_CloneHeader(&file->header);
+    assert(file->header.shared_offset == -1);
+    assert((uint64_t) file->header.num_dirty <= file->num_local_lps);
+#endif
+}
+
+/** A branch of this group waiting on disk */
+struct SpilledBranch {
+    uint64_t branch;
+    bool resumed;     /**< Still in the resume directory (instead of the spill directory) */
+};
+
+// Branches of this group on disk, oldest first. The same on all members of
+// the group. New branches only go to the pool once there is none on disk
+static struct SpilledBranch *spilled_branches = NULL;
+static int num_spilled_branches = 0;
+static int spilled_branches_capacity = 0;
+
+static void spill_file_path(char *path, size_t size, char const *dir, uint64_t branch) {
+    snprintf(path, size, "%s/branch-%" PRIu64 ".m%d.bin", dir, branch, search_my_member());
+}
+
+// Rank 0 creates the directory first, so that on a shared file system the
+// first rank of every node finds it there already
+static void create_spill_dir(void) {
+    if (g_tw_mynode == 0) {
+        check_folder(spill_dir);
+    }
+    MPI_Barrier(clone_comm);
+
+    MPI_Comm node;
+    int node_rank;
+    MPI_Comm_split_type(clone_comm, MPI_COMM_TYPE_SHARED, (int) g_tw_mynode, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &node_rank);
+    if (node_rank == 0 && g_tw_mynode != 0) {
+        check_folder(spill_dir);
+    }
+    MPI_Comm_free(&node);
+    MPI_Barrier(clone_comm);
+}
+
+// Writes the tile of this member of a branch to the spill directory
+static void write_spill_file(struct CloneHeader const *header, struct CellDelta const *cells,
+                             tw_rng_stream const *rngs, struct SerializableEvent const *events) {
+    struct SpillFileHeader file = {
+        .group_size = g_tiling.group_size,
+        .member = search_my_member(),
+        .grid_width = g_grid_width,
+        .grid_height = g_grid_height,
+        .tiles_x = g_tiling.tiles_x,
+        .tiles_y = g_tiling.tiles_y,
+        .num_free_cells = g_num_free_cells,
+        .member_lp_base = g_tiling.lp_base[search_my_member()],
+        .num_local_lps = search_mapping_num_local_lps(),
+        .event_size = serializable_event_size(),
+        .header = *header,
+    };
+    memcpy(file.magic, SPILL_MAGIC, sizeof(file.magic));
+    file.header.shared_offset = -1;
+    assert_valid_SpillFileHeader(&file);
+
+    char path[256];
+    spill_file_path(path, sizeof(path), spill_dir, header->branch);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        tw_error(TW_LOC, "Cannot create the spill file %s", path);
+    }
+    if (fwrite(&file, sizeof(file), 1, fp) != 1
+        || fwrite(cells, sizeof(*cells), header->num_dirty, fp) != (size_t) header->num_dirty
+        || fwrite(rngs, sizeof(*rngs), header->num_dirty, fp) != (size_t) header->num_dirty
+        || fwrite(events, serializable_event_size(), header->num_events, fp) != (size_t) header->num_events
+        || fclose(fp) != 0) {
+        tw_error(TW_LOC, "Failed to write the spill file %s", path);
+    }
+}
+
+// Reads the tile of this member of `branch` from `dir` and removes the file.
+// Timestamps are rebased as if the snapshot had been taken at GVT 0, since it
+// may come from an earlier run that got further. `install_branch` shifts
+// them forward to the GVT at which the branch starts
+static void read_spill_file(char const *dir, uint64_t branch, struct BranchSnapshot *snapshot) {
+    char path[256];
+    spill_file_path(path, sizeof(path), dir, branch);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        tw_error(TW_LOC, "Cannot open the spill file %s", path);
+    }
+    struct SpillFileHeader file;
+    if (fread(&file, sizeof(file), 1, fp) != 1 || !is_valid_SpillFileHeader(&file) || file.header.branch != branch) {
+        tw_error(TW_LOC, "%s is not a branch of this grid, tiling, group size, queries and mode", path);
+    }
+
+    snapshot->header = file.header;
+    size_t const states_size = file.header.num_dirty * sizeof(struct CellDelta);
+    size_t const events_size = file.header.num_events * serializable_event_size();
+    size_t const rngs_size = file.header.num_dirty * sizeof(tw_rng_stream);
+    snapshot->cells = malloc(states_size > 0 ? states_size : 1);
+    snapshot->rngs = malloc(rngs_size > 0 ? rngs_size : 1);
+    snapshot->events = malloc(events_size > 0 ? events_size : 1);
+    if (!snapshot->cells || !snapshot->rngs || !snapshot->events) {
+        tw_error(TW_LOC, "Failed to allocate memory for the branch in %s", path);
+    }
+    if (fread(snapshot->cells, sizeof(struct CellDelta), file.header.num_dirty, fp) != (size_t) file.header.num_dirty
+        || fread(snapshot->rngs, sizeof(tw_rng_stream), file.header.num_dirty, fp) != (size_t) file.header.num_dirty
+        || fread(snapshot->events, serializable_event_size(), file.header.num_events, fp)
+           != (size_t) file.header.num_events) {
+        tw_error(TW_LOC, "The spill file %s is truncated", path);
+    }
+    fclose(fp);
+    remove(path);
+
+    snapshot->header.decision.timestamp -= file.header.gvt;
+    for (int i = 0; i < snapshot->header.num_events; i++) {
+        serializable_event_at(snapshot->events, i)->recv_ts -= file.header.gvt;
+    }
+    snapshot->header.gvt = 0;
+    assert_valid_BranchSnapshot(snapshot);
+}
+
+static void push_spilled_branch(uint64_t branch, bool resumed) {
+    if (num_spilled_branches == spilled_branches_capacity) {
+        int const new_capacity = spilled_branches_capacity ? 2 * spilled_branches_capacity : 64;
+        struct SpilledBranch *grown = realloc(spilled_branches, new_capacity * sizeof(*spilled_branches));
+        if (!grown) {
+            tw_error(TW_LOC, "Failed to allocate the list of %d spilled branches", new_capacity);
         }
+        spilled_branches = grown;
+        spilled_branches_capacity = new_capacity;
     }
+    spilled_branches[num_spilled_branches++] = (struct SpilledBranch) {branch, resumed};
 }
 
-static void clone_lp_states(tw_pe *pe, tw_peid source, tw_peid dest) {
-    assert(g_tw_mynode == source || g_tw_mynode == dest);
+// Moves the oldest branches on disk into the pool, as long as it has room
+static void refill_pool_from_disk(tw_pe *pe) {
+    int taken = 0;
+    while (branch_pool_size < BRANCH_POOL_CAPACITY && taken < num_spilled_branches) {
+        double const began = hook_stats_begin();
+        struct SpilledBranch const *spilled = &spilled_branches[taken++];
+        struct BranchSnapshot *snapshot = &branch_pool[branch_pool_size++];
+        read_spill_file(spilled->resumed ? resume_dir : spill_dir, spilled->branch, snapshot);
 
-    int total_lps = g_grid_width * g_grid_height;
-    assert(total_lps == (int) g_tw_nlp);
+        double const seconds = hook_stats_end(HOOK_PHASE_pool, began);
+        hook_stats_transfer(BRANCH_TRANSFER_loaded, -1,
+                            snapshot->header.num_dirty, snapshot->header.num_dirty * sizeof(struct CellDelta),
+                            snapshot->header.num_events, snapshot->header.num_events * serializable_event_size(),
+                            0, 0, seconds, pe->GVT_sig.recv_ts);
+    }
+    num_spilled_branches -= taken;
+    memmove(&spilled_branches[0], &spilled_branches[taken], num_spilled_branches * sizeof(struct SpilledBranch));
+}
 
-    MPI_Request *requests = malloc(g_tw_nlp * sizeof(MPI_Request));
+static int compare_branch_ids(void const *a, void const *b) {
+    uint64_t const left = *(uint64_t const *) a;
+    uint64_t const right = *(uint64_t const *) b;
+    return (left > right) - (left < right);
+}
 
-    for (tw_lpid local_lpid = 0; local_lpid < g_tw_nlp; local_lpid++) {
-        tw_lp *lp = g_tw_lp[local_lpid];
-        struct SearchCellState *state = (struct SearchCellState *)lp->cur_state;
+// Spreads the branches found in the resume directory (by rank 0, which must
+// see it, as all ranks do) over the groups in order of id: group g takes the
+// i-th branch when i % num_groups == g. The first ones go to the pool, the
+// rest stay on disk. Branch ids of this run start past the resumed ones.
+// Returns the number of branches found
+static int resume_branches(void) {
+    int num_branches = 0;
+    uint64_t *branches = NULL;
+    if (g_tw_mynode == 0) {
+        DIR *dir = opendir(resume_dir);
+        if (!dir) {
+            tw_error(TW_LOC, "Cannot open the resume directory %s", resume_dir);
+        }
+        int capacity = 0;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            uint64_t branch;
+            int end = 0;
+            if (sscanf(entry->d_name, "branch-%" SCNu64 ".m0.bin%n", &branch, &end) != 1
+                || end == 0 || entry->d_name[end] != '\0') {
+                continue;
+            }
+            if (num_branches == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                branches = realloc(branches, capacity * sizeof(*branches));
+                if (!branches) {
+                    tw_error(TW_LOC, "Failed to allocate the list of %d resumed branches", capacity);
+                }
+            }
+            branches[num_branches++] = branch;
+        }
+        closedir(dir);
+        qsort(branches, num_branches, sizeof(*branches), compare_branch_ids);
+    }
+    MPI_Bcast(&num_branches, 1, MPI_INT, 0, clone_comm);
+    if (g_tw_mynode != 0) {
+        branches = malloc((num_branches > 0 ? num_branches : 1) * sizeof(*branches));
+        if (!branches) {
+            tw_error(TW_LOC, "Failed to allocate the list of %d resumed branches", num_branches);
+        }
+    }
+    MPI_Bcast(branches, num_branches, MPI_UINT64_T, 0, clone_comm);
 
-        if (g_tw_mynode == source) {
-            MPI_Isend(state, sizeof(struct SearchCellState), MPI_BYTE, dest,
-                      0, MPI_COMM_ROSS, &requests[local_lpid]);
+    int const num_groups = tw_nnodes() / g_tiling.group_size;
+    for (int i = search_my_group(); i < num_branches; i += num_groups) {
+        if (branch_pool_size < BRANCH_POOL_CAPACITY) {
+            read_spill_file(resume_dir, branches[i], &branch_pool[branch_pool_size++]);
         } else {
-            MPI_Irecv(state, sizeof(struct SearchCellState), MPI_BYTE, source,
-                      0, MPI_COMM_ROSS, &requests[local_lpid]);
+            push_spilled_branch(branches[i], true);
+        }
+    }
+    for (int i = 0; i < num_branches; i++) {
+        uint32_t const count = (uint32_t) branches[i];
+        if (count >= num_branch_ids) {
+            num_branch_ids = count + 1;
         }
     }
+    free(branches);
+    return num_branches;
+}
+
+/** Where the second branch of a decision goes when no group can take it */
+enum POOL_RESULT {
+    POOL_RESULT_stored = 0,  /**< Into the pool */
+    POOL_RESULT_spilled,     /**< To the spill directory, as the pool is full */
+    POOL_RESULT_dropped      /**< Nowhere, the pool is full and there is no spill directory */
+};
+
+// Stores the second branch of the current decision in the pool, to be
+// started later on by the first PE to become free. Once the pool is full, it
+// is written to disk if there is a spill directory, and dropped otherwise
+static enum POOL_RESULT store_branch_in_pool(tw_pe *pe, uint64_t branch) {
+    if (branch_pool_size == BRANCH_POOL_CAPACITY && !spill_dir) {
+        return POOL_RESULT_dropped;
+    }
+    double began = hook_stats_begin();
+
+    struct CloneHeader header = {
+        .decision = current_decision,
+        .branch = branch,
+        .parent = current_branch,
+        .query = g_current_query,
+        .shared_offset = -1,
+        .gvt = pe->GVT_sig.recv_ts,
+    };
+    reserve_state_buffer(search_lp_num_dirty() * sizeof(struct CellDelta));
+    header.num_dirty = pack_dirty_lp_states((struct CellDelta *) state_buffer);
+    tw_rng_stream *rngs = pack_lp_rngs((struct CellDelta *) state_buffer, header.num_dirty);
+    double const pack_seconds = hook_stats_end(HOOK_PHASE_pack_states, began);
+
+    began = hook_stats_begin();
+    reserve_event_buffer(tw_pq_get_size(pe->pq));
+    header.num_events = snapshot_pending_events(pe, event_buffer);
+    assert_valid_CloneHeader(&header);
+    double const snapshot_seconds = hook_stats_end(HOOK_PHASE_snapshot_events, began);
+
+    began = hook_stats_begin();
+    size_t const states_size = header.num_dirty * sizeof(struct CellDelta);
+    size_t const events_size = header.num_events * serializable_event_size();
+
+    // Older branches on disk go into the pool before this one
+    if (branch_pool_size == BRANCH_POOL_CAPACITY || num_spilled_branches > 0) {
+        write_spill_file(&header, (struct CellDelta *) state_buffer, rngs, event_buffer);
+        free(rngs);
+        push_spilled_branch(branch, false);
+        double const seconds = hook_stats_end(HOOK_PHASE_pool, began);
+        hook_stats_transfer(BRANCH_TRANSFER_spilled, -1, header.num_dirty, states_size,
+                            header.num_events, events_size, pack_seconds, snapshot_seconds,
+                            pack_seconds + snapshot_seconds + seconds, pe->GVT_sig.recv_ts);
+        return POOL_RESULT_spilled;
+    }
+
+    // Only the exact amount of memory is kept for the (possibly long) stay in the pool
+    struct BranchSnapshot *snapshot = &branch_pool[branch_pool_size];
+    snapshot->header = header;
+    snapshot->rngs = rngs;
+    snapshot->cells = malloc(states_size > 0 ? states_size : 1);
+    snapshot->events = malloc(events_size > 0 ? events_size : 1);
+    if (!snapshot->cells || !snapshot->events) {
+        tw_error(TW_LOC, "Failed to allocate memory for a pooled branch");
+    }
+    memcpy(snapshot->cells, state_buffer, states_size);
+    memcpy(snapshot->events, event_buffer, events_size);
+
+    assert_valid_BranchSnapshot(snapshot);
+    branch_pool_size++;
+
+    double const seconds = hook_stats_end(HOOK_PHASE_pool, began);
+    hook_stats_transfer(BRANCH_TRANSFER_stored, -1, header.num_dirty, states_size,
+                        header.num_events, events_size, pack_seconds, snapshot_seconds,
+                        pack_seconds + snapshot_seconds + seconds, pe->GVT_sig.recv_ts);
+    return POOL_RESULT_stored;
+}
+
+// Takes the oldest branch out of the pool
+static void pop_pooled_branch(struct BranchSnapshot *snapshot) {
+    assert(branch_pool_size > 0);
+
+    *snapshot = branch_pool[0];
+    branch_pool_size--;
+    memmove(&branch_pool[0], &branch_pool[1], branch_pool_size * sizeof(struct BranchSnapshot));
+}
+
+// Sends the oldest branch in the pool to `dest`
+static void send_pooled_branch(tw_pe *pe, tw_peid dest) {
+    assert(num_in_flight_branches < BRANCH_POOL_CAPACITY);
+
+    double const began = hook_stats_begin();
+    struct BranchSnapshot *snapshot = &in_flight_branches[num_in_flight_branches++];
+    pop_pooled_branch(snapshot);
+    post_branch_send(&snapshot->header, snapshot->cells, snapshot->events, dest);
+
+    double const seconds = hook_stats_end(HOOK_PHASE_send, began);
+    hook_stats_transfer(BRANCH_TRANSFER_pooled_sent, (int) dest,
+                        snapshot->header.num_dirty, snapshot->header.num_dirty * sizeof(struct CellDelta),
+                        snapshot->header.num_events, snapshot->header.num_events * serializable_event_size(),
+                        0, 0, seconds, pe->GVT_sig.recv_ts);
+}
+
+// Installs a branch on this (empty) group. The snapshot was taken at an
+// earlier GVT, so all its timestamps are shifted forward by the time elapsed
+// since then, keeping every event in the future of the current GVT. Branches
+// coming from another group have no `rngs`: the LPs of this group go on with
+// their own streams. Unless the branch was already running, the caller has
+// to advance it to its direction
+static void install_branch(tw_pe *pe, struct CloneHeader const *header, struct CellDelta const *cells,
+                           tw_rng_stream const *rngs, struct SerializableEvent const *events) {
+    tw_stime const shift = pe->GVT_sig.recv_ts - header->gvt;
+    assert(shift >= 0);
+    unpack_dirty_lp_states(cells, header->num_dirty);
+    if (rngs) {
+        unpack_lp_rngs(cells, rngs, header->num_dirty);
+    }
+    install_events(pe, events, header->num_events, shift);
+    current_origin = header->decision;
+    current_origin.timestamp += shift;
+    current_parent = header->parent;
+    if (header->running) {
+        clean_current_decision();
+    } else {
+        current_decision = current_origin;
+    }
+    current_branch = header->branch;
+    query_select(header->query);
+}
+
+// Receives a branch from `source` into `header`, pointing `cells` and
+// `events` to where it is (the receive buffers, or the shared segment of the
+// source). Once done with them, `release_received_branch` must be called
+static void receive_branch(tw_peid source, struct CloneHeader *header, struct CellDelta const **cells,
+                           struct SerializableEvent const **events) {
+    MPI_Recv(header, sizeof(struct CloneHeader), MPI_BYTE, source,
+             CLONE_TAG_header, clone_comm, MPI_STATUS_IGNORE);
+    assert_valid_CloneHeader(header);
+
+    size_t const states_size = header->num_dirty * sizeof(struct CellDelta);
+    size_t const events_size = header->num_events * serializable_event_size();
+    if (header->shared_offset >= 0) {
+        assert(shared_win != MPI_WIN_NULL && node_rank_of[source] != MPI_UNDEFINED);
+        MPI_Win_sync(shared_win);
+        char const *segment = shared_segments[node_rank_of[source]] + header->shared_offset;
+        *cells = (struct CellDelta const *) segment;
+        *events = (struct SerializableEvent const *) (segment + states_size);
+        return;
+    }
 
-    MPI_Waitall(g_tw_nlp, requests, MPI_STATUSES_IGNORE);
-    free(requests);
+    reserve_state_buffer(states_size);
+    reserve_event_buffer(header->num_events);
+    int const num_state_chunks = num_chunks_for(states_size);
+    int const num_requests = num_state_chunks + num_chunks_for(events_size);
+    MPI_Request requests[num_requests > 0 ? num_requests : 1];
+    post_chunked(false, state_buffer, states_size, source, CLONE_TAG_states, requests);
+    post_chunked(false, event_buffer, events_size, source, CLONE_TAG_events, &requests[num_state_chunks]);
+    MPI_Waitall(num_requests, requests, MPI_STATUSES_IGNORE);
+    *cells = (struct CellDelta const *) state_buffer;
+    *events = event_buffer;
+}
+
+// Lets the source reuse the part of its shared segment the branch was in
+static void release_received_branch(tw_peid source, struct CloneHeader const *header) {
+    if (header->shared_offset >= 0) {
+        MPI_Send(NULL, 0, MPI_BYTE, source, CLONE_TAG_ack, clone_comm);
+    }
 }
 
-void director_store_decision(int x, int y, enum DIRECTION chosen_dir, enum DIRECTION second_dir, tw_stime timestamp) {
+// Destination side of a clone. The destination has nothing to simulate, so
+// it installs the branch as soon as all receives complete, and leaves its
+// header in `header`
+static void receive_clone(tw_pe *pe, tw_peid source, struct CloneHeader *header) {
+    double const began = hook_stats_begin();
+    struct CellDelta const *cells;
+    struct SerializableEvent const *events;
+    receive_branch(source, header, &cells, &events);
+    install_branch(pe, header, cells, NULL, events);
+    release_received_branch(source, header);
+
+    size_t const states_size = header->num_dirty * sizeof(struct CellDelta);
+    size_t const events_size = header->num_events * serializable_event_size();
+    double const seconds = hook_stats_end(HOOK_PHASE_receive, began);
+    hook_stats_transfer(BRANCH_TRANSFER_received, (int) source, header->num_dirty, states_size,
+                        header->num_events, events_size, 0, 0, seconds, pe->GVT_sig.recv_ts);
+}
+
+void director_store_decision(int x, int y, enum DIRECTION chosen_dir, enum DIRECTION second_dir, tw_stime timestamp,
+                             struct AgentTrail const *trail) {
     // Store the decision
     current_decision.x = x;
     current_decision.y = y;
     current_decision.chosen_dir = chosen_dir;
     current_decision.second_dir = second_dir;
     current_decision.timestamp = timestamp;
+    if (trail) {
+        current_decision.trail = *trail;
+    }
 
     did_this_pe_trigger = true;
 }
@@ -197,7 +1214,31 @@ void director_store_decision_rev(int x, int y) {
     clean_current_decision();
 }
 
+void director_branch_finished(tw_stime at) {
+    branch_finished = true;
+    branch_finished_at = at;
+}
+
+void director_goal_reached(tw_lp *lp) {
+    goal_reached = true;
+    if (g_stop_on_first_goal) {
+        tw_trigger_gvt_hook_now(lp);
+    }
+}
+
+void director_goal_reached_rev(tw_lp *lp) {
+    goal_reached = false;
+    if (g_stop_on_first_goal) {
+        tw_trigger_gvt_hook_now_rev(lp);
+    }
+}
+
+// Only the member whose tile holds the decision cell moves the agent
 void advance_to_direction(tw_pe *pe, enum OPTION opt) {
+    if (!search_cell_is_local(current_decision.x, current_decision.y)) {
+        return;
+    }
+    double const began = hook_stats_begin();
     tw_event_sig gvt_sig = pe->GVT_sig;
     tw_stime gvt = gvt_sig.recv_ts;
 
@@ -221,85 +1262,855 @@ void advance_to_direction(tw_pe *pe, enum OPTION opt) {
            direction_names[current_decision.second_dir]);
 
     // Finding LP
-    tw_lpid local_lpid = grid_index(current_decision.x, current_decision.y);
+    tw_lpid local_lpid = grid_lp_of_cell(current_decision.x, current_decision.y)
+                       - g_tiling.lp_base[search_my_member()];
     tw_lp * grid_lp = g_tw_lp[local_lpid];
     synch_lp_to_gvt(pe, grid_lp, &gvt_sig);
 
-    send_agent_move(grid_lp, current_decision.x, current_decision.y, dir, current_decision.timestamp + 1.0);
+    send_agent_move(grid_lp, current_decision.x, current_decision.y, dir, current_decision.timestamp + 1.0,
+                    &current_decision.trail);
+    hook_stats_end(HOOK_PHASE_advance, began);
+}
+
+// Starts the oldest branch in the pool on this (empty) group, with no need to
+// transfer it
+static void start_pooled_branch(tw_pe *pe) {
+    double const began = hook_stats_begin();
+    struct BranchSnapshot snapshot;
+    pop_pooled_branch(&snapshot);
+    if (search_my_member() == 0) {
+        printf("PE %d - Starting pooled branch (%d left in pool)\n", (int) g_tw_mynode, branch_pool_size);
+    }
+
+    install_branch(pe, &snapshot.header, snapshot.cells, snapshot.rngs, snapshot.events);
+    log_branch(snapshot.header.running ? CLONE_EVENT_resumed : CLONE_EVENT_unpooled, current_branch,
+               snapshot.header.parent, pe->GVT_sig.recv_ts,
+               (int) g_tw_mynode);
+    double const seconds = hook_stats_end(HOOK_PHASE_receive, began);
+    hook_stats_transfer(BRANCH_TRANSFER_unpooled, -1,
+                        snapshot.header.num_dirty, snapshot.header.num_dirty * sizeof(struct CellDelta),
+                        snapshot.header.num_events, snapshot.header.num_events * serializable_event_size(),
+                        0, 0, seconds, pe->GVT_sig.recv_ts);
+    bool const running = snapshot.header.running;
+    free_BranchSnapshot(&snapshot);
+
+    if (!running) {
+        advance_to_direction(pe, OPTION_second_branch);
+    }
+    my_pe_state = PE_BUSY;
+}
+
+// Records the results of the finished branch and leaves the group ready to
+// receive a new one. If there are branches in the pool, the oldest one is
+// started right away on this group. Collective over the group
+static void recycle_finished_group(tw_pe *pe) {
+    double const began = hook_stats_begin();
+
+    // Only dirty LPs can have been visited
+    for (size_t page = 0; page < search_lp_num_pages(); page++) {
+        if (!search_lp_page_is_dirty(page)) continue;
+        for (tw_lpid local_lpid = page * LP_PAGE_SIZE; local_lpid < search_lp_page_end(page); local_lpid++) {
+            tw_lp *lp = g_tw_lp[local_lpid];
+            search_lp_final(lp->cur_state, lp);
+        }
+    }
+    results_gather(group_comm);
+    if (search_my_member() == 0) {
+        query_record_branch(g_current_query, result_was_visited(g_goal_x, g_goal_y));
+        write_branch_output();
+    }
+    results_clear();
+    hook_stats_end(HOOK_PHASE_recycle, began);
+
+    branch_finished = false;
+    branch_finished_at = -1;
+    goal_reached = false;
+
+    if (branch_pool_size > 0) {
+        start_pooled_branch(pe);
+    } else {
+        reset_dirty_lp_states();
+        current_branch = BRANCH_NONE;
+        my_pe_state = PE_EMPTY;
+    }
+}
+
+// Keeps the second branch of the current decision, which no empty group
+// took, and reports where it went
+static void pool_second_branch(tw_pe *pe, uint64_t child_branch) {
+    int const group_pe = search_my_group() * g_tiling.group_size;
+    tw_stime const gvt = pe->GVT_sig.recv_ts;
+    assert_valid_DecisionInfo(&current_decision);
+    switch (store_branch_in_pool(pe, child_branch)) {
+        case POOL_RESULT_stored:
+            log_branch(CLONE_EVENT_pooled, child_branch, current_branch, gvt, group_pe);
+            if (search_my_member() == 0) {
+                printf("PE %d - No empty PE, branch stored in pool (%d pooled)\n", (int) g_tw_mynode, branch_pool_size);
+            }
+        break;
+        case POOL_RESULT_spilled:
+            log_branch(CLONE_EVENT_spilled, child_branch, current_branch, gvt, group_pe);
+            if (search_my_member() == 0) {
+                printf("PE %d - No empty PE and pool is full, branch spilled to disk (%d on disk)\n",
+                       (int) g_tw_mynode, num_spilled_branches);
+            }
+        break;
+        case POOL_RESULT_dropped:
+            log_branch(CLONE_EVENT_dropped, child_branch, current_branch, gvt, -1);
+            if (search_my_member() == 0) {
+                printf("PE %d - No empty PE and pool is full, branch dropped\n", (int) g_tw_mynode);
+            }
+        break;
+    }
+}
+
+// Starts a new query on this (empty) group. Its LPs are all clean already,
+// so the agent only has to be placed on the start cell
+static void start_query(tw_pe *pe, int query) {
+    query_select(query);
+    current_branch = new_branch_id();
+    set_root_origin(pe->GVT_sig.recv_ts);
+    log_branch(CLONE_EVENT_root, current_branch, BRANCH_NONE, pe->GVT_sig.recv_ts, (int) g_tw_mynode);
+    if (search_my_member() == 0) {
+        printf("PE %d - Starting query %d: (%d,%d) to (%d,%d)\n",
+               (int) g_tw_mynode, query, g_start_x, g_start_y, g_goal_x, g_goal_y);
+    }
+    if (search_cell_is_local(g_start_x, g_start_y)) {
+        tw_event_sig gvt_sig = pe->GVT_sig;
+        tw_lp *start_lp = g_tw_lp[grid_lp_of_cell(g_start_x, g_start_y) - g_tiling.lp_base[search_my_member()]];
+        synch_lp_to_gvt(pe, start_lp, &gvt_sig);
+        send_agent_start(start_lp);
+    }
+    my_pe_state = PE_BUSY;
+}
+
+/** Status of a PE, as shared with all other PEs in every GVT hook */
+struct PeStatus {
+    enum PE_STATE state;
+    int num_pooled;       /**< Number of branches waiting in the pool of the PE */
+    bool goal_reached;    /**< Whether the agent of the PE has reached the goal (at or before GVT) */
+    bool branch_done;     /**< Whether the branch stopped and all of its events are committed */
+};
+
+/** Status of a clone group, summarized from the status of its members */
+struct GroupStatus {
+    enum PE_STATE state;
+    int trigger_member;   /**< Member that triggered the hook (if state == PE_REQUEST_CLONING) */
+    int num_pooled;       /**< Number of branches waiting in the pool of the group */
+    bool goal_reached;
+    bool branch_done;
+};
+
+// The agent of a branch is on a single member at a time, so that member is
+// the one reporting decisions, goals and the end of the branch. Pools are the
+// same on every member (each one keeps its own tile of the snapshots)
+static void summarize_groups(struct PeStatus const *all_pe_status, struct GroupStatus *groups, int num_groups) {
+    int const group_size = g_tiling.group_size;
+    for (int group = 0; group < num_groups; group++) {
+        struct PeStatus const *members = &all_pe_status[group * group_size];
+        groups[group] = (struct GroupStatus) {
+            .state = members[0].state == PE_EMPTY ? PE_EMPTY : PE_BUSY,
+            .trigger_member = -1,
+            .num_pooled = members[0].num_pooled,
+        };
+        for (int member = 0; member < group_size; member++) {
+            if (members[member].state == PE_REQUEST_CLONING && groups[group].trigger_member < 0) {
+                groups[group].state = PE_REQUEST_CLONING;
+                groups[group].trigger_member = member;
+            }
+            groups[group].goal_reached |= members[member].goal_reached;
+            groups[group].branch_done |= members[member].branch_done;
+        }
+    }
+}
+
+// Receives every ROSS message still in flight between the ranks of the group
+// (events sent to the tile of another member, or cancellations sent by the
+// rollback), so that the pending events snapshotted by the hook are all of
+// them. It is the same loop ROSS runs to compute GVT, restricted to the group,
+// as LPs only talk to LPs of their own group
+static void drain_group_network(tw_pe *pe) {
+    long long in_flight;
+    do {
+        tw_net_read(pe);
+        long long const mine = (long long) pe->s_nwhite_sent - (long long) pe->s_nwhite_recv;
+        MPI_Allreduce(&mine, &in_flight, 1, MPI_LONG_LONG, MPI_SUM, group_comm);
+    } while (in_flight != 0);
+}
+
+// Ends the simulation on all PEs at the current GVT, because the group led by
+// PE `winner` found the goal. Every PE takes the same decision, as all see the same states
+static void stop_all_pes(tw_pe *pe, int winner) {
+    tw_stime const gvt = pe->GVT_sig.recv_ts;
+    if (g_tw_mynode == 0) {
+        printf("Goal found by PE %d, stopping all PEs at GVT %f (see the results of PE %d)\n",
+               winner, gvt, winner);
+    }
+    g_tw_ts_end = gvt;
+    did_this_pe_trigger = false;
+}
+
+// ================================= One-sided allocation ================================
+
+// With one-sided allocation, empty groups are kept in a stack on rank 0 that
+// groups claim from through an MPI window, instead of every PE sharing its
+// status with every other PE. There is no barrier: only the groups that
+// claim, and the ones they claim, ever take part. The claiming group sends
+// the first member of the claimed group an assignment (`CLONE_TAG_assign`),
+// one int:
+// - 0 <= s < num_groups: the second branch of a decision, from group s
+// - num_groups <= s: a pooled branch, from group s - num_groups
+// - s <= -2: query -2 - s, to be started from scratch (sent by rank 0)
+// and then raises the `pending` flag in the window of that member. A group
+// looks at its flag in every hook and receives the assignment when it is
+// raised. The claim may happen after the claimed group went through this
+// hook, in which case the branch is installed in the next one (its
+// timestamps are shifted by the GVT elapsed in between, see `install_branch`)
+
+/** Ints in the allocation window of every rank (only rank 0 holds the stack) */
+enum WINDOW_SLOT {
+    WINDOW_SLOT_pending = 0,   /**< Whether an assignment was sent to the rank (first member of a group) */
+    WINDOW_SLOT_free_top,      /**< Number of empty groups in the stack (rank 0) */
+    WINDOW_SLOT_free_stack     /**< First of the empty groups (rank 0) */
+};
+
+static MPI_Win allocation_win = MPI_WIN_NULL;
+static int *allocation_slots = NULL;
+
+// Assignments sent in this hook, kept until their sends complete with the
+// other outgoing transfers. A group is claimed at most once a hook, so there
+// are never more than the number of groups
+static int *outgoing_assignments = NULL;
+static int num_outgoing_assignments = 0;
+
+// Every group but the first `num_busy_groups` starts empty. The lowest groups
+// are on top, so they are claimed first
+static void allocation_window_init(int num_busy_groups) {
+    int const num_groups = tw_nnodes() / g_tiling.group_size;
+    MPI_Aint const num_slots = WINDOW_SLOT_free_stack + (g_tw_mynode == 0 ? num_groups : 0);
+    MPI_Win_allocate(num_slots * sizeof(int), sizeof(int), MPI_INFO_NULL, clone_comm,
+                     &allocation_slots, &allocation_win);
+    outgoing_assignments = malloc(num_groups * sizeof(int));
+    if (!outgoing_assignments) {
+        tw_error(TW_LOC, "Failed to allocate the outgoing assignments of %d groups", num_groups);
+    }
+
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, (int) g_tw_mynode, 0, allocation_win);
+    allocation_slots[WINDOW_SLOT_pending] = 0;
+    allocation_slots[WINDOW_SLOT_free_top] = 0;
+    if (g_tw_mynode == 0) {
+        for (int group = num_groups - 1; group >= num_busy_groups; group--) {
+            allocation_slots[WINDOW_SLOT_free_stack + allocation_slots[WINDOW_SLOT_free_top]++] = group;
+        }
+    }
+    MPI_Win_unlock((int) g_tw_mynode, allocation_win);
+    MPI_Barrier(clone_comm);
 }
 
-void clone_branch_and_advance(tw_pe *pe, tw_peid source, tw_peid dest) {
-    if (g_tw_mynode != source && g_tw_mynode != dest) {
+static void allocation_window_free(void) {
+    if (allocation_win == MPI_WIN_NULL) {
         return;
     }
+    MPI_Win_free(&allocation_win);
+    allocation_slots = NULL;
+    free(outgoing_assignments);
+    outgoing_assignments = NULL;
+}
+
+// Pushes and pops hold the lock of rank 0 for their whole read-modify-write
+static void push_free_group(int group) {
+    double const began = hook_stats_begin();
+    int top;
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, allocation_win);
+    MPI_Get(&top, 1, MPI_INT, 0, WINDOW_SLOT_free_top, 1, MPI_INT, allocation_win);
+    MPI_Win_flush(0, allocation_win);
+    int const new_top = top + 1;
+    MPI_Put(&group, 1, MPI_INT, 0, WINDOW_SLOT_free_stack + top, 1, MPI_INT, allocation_win);
+    MPI_Put(&new_top, 1, MPI_INT, 0, WINDOW_SLOT_free_top, 1, MPI_INT, allocation_win);
+    MPI_Win_unlock(0, allocation_win);
+    hook_stats_end(HOOK_PHASE_claim, began);
+}
+
+// Returns an empty group, or -1 if there is none
+static int pop_free_group(void) {
+    int top, group = -1;
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, allocation_win);
+    MPI_Get(&top, 1, MPI_INT, 0, WINDOW_SLOT_free_top, 1, MPI_INT, allocation_win);
+    MPI_Win_flush(0, allocation_win);
+    if (top > 0) {
+        int const new_top = top - 1;
+        MPI_Get(&group, 1, MPI_INT, 0, WINDOW_SLOT_free_stack + new_top, 1, MPI_INT, allocation_win);
+        MPI_Put(&new_top, 1, MPI_INT, 0, WINDOW_SLOT_free_top, 1, MPI_INT, allocation_win);
+    }
+    MPI_Win_unlock(0, allocation_win);
+    return group;
+}
 
-    clone_lp_states(pe, source, dest);
-    clone_events(pe, source, dest);
+// Tells `group` what it is going to receive. The message is posted first, so
+// the group never finds its flag raised without an assignment on its way. The
+// send does not block, as the group may only look at its flag in the next hook
+static void assign_group(int group, int assigned) {
+    int const leader = group * g_tiling.group_size;
+    int const raised = 1;
+    int *message = &outgoing_assignments[num_outgoing_assignments++];
+    *message = assigned;
+    reserve_outgoing_requests(1);
+    MPI_Isend(message, 1, MPI_INT, leader, CLONE_TAG_assign, clone_comm, &outgoing_requests[num_outgoing_requests++]);
+    MPI_Win_lock(MPI_LOCK_SHARED, leader, 0, allocation_win);
+    MPI_Accumulate(&raised, 1, MPI_INT, leader, WINDOW_SLOT_pending, 1, MPI_INT, MPI_REPLACE, allocation_win);
+    MPI_Win_unlock(leader, allocation_win);
+}
 
-    if (did_this_pe_trigger) {
-        assert(source == g_tw_mynode);
+// The assignment of this group, or -1 if it has none yet. Collective over the group
+static int receive_assignment(void) {
+    double const began = hook_stats_begin();
+    int assigned = -1;
+    if (search_my_member() == 0) {
+        int const lowered = 0;
+        int pending;
+        MPI_Win_lock(MPI_LOCK_SHARED, (int) g_tw_mynode, 0, allocation_win);
+        MPI_Fetch_and_op(&lowered, &pending, MPI_INT, (int) g_tw_mynode, WINDOW_SLOT_pending,
+                         MPI_REPLACE, allocation_win);
+        MPI_Win_unlock((int) g_tw_mynode, allocation_win);
+        if (pending) {
+            MPI_Recv(&assigned, 1, MPI_INT, MPI_ANY_SOURCE, CLONE_TAG_assign, clone_comm, MPI_STATUS_IGNORE);
+        }
+    }
+    if (g_tiling.group_size > 1) {
+        MPI_Bcast(&assigned, 1, MPI_INT, 0, group_comm);
+    }
+    hook_stats_end(HOOK_PHASE_claim, began);
+    return assigned;
+}
+
+// The first member of the group claims up to `count` empty groups, and shares
+// them with the rest of the group. Returns how many it got
+static int claim_free_groups(int count, int *claimed) {
+    double const began = hook_stats_begin();
+    int num_claimed = 0;
+    if (search_my_member() == 0) {
+        while (num_claimed < count) {
+            int const group = pop_free_group();
+            if (group < 0) {
+                break;
+            }
+            claimed[num_claimed++] = group;
+        }
+    }
+    if (g_tiling.group_size > 1) {
+        MPI_Bcast(&num_claimed, 1, MPI_INT, 0, group_comm);
+        MPI_Bcast(claimed, num_claimed, MPI_INT, 0, group_comm);
+    }
+    hook_stats_end(HOOK_PHASE_claim, began);
+    return num_claimed;
+}
+
+// Starts whatever this (empty) group was assigned, if anything yet
+static void take_assignment(tw_pe *pe) {
+    int const group_size = g_tiling.group_size;
+    int const num_groups = tw_nnodes() / group_size;
+    int const assigned = receive_assignment();
+    if (assigned <= -2) {
+        start_query(pe, -2 - assigned);
+    } else if (assigned >= 0) {
+        int const source_group = assigned % num_groups;
+        struct CloneHeader header;
+        receive_clone(pe, source_group * group_size + search_my_member(), &header);
+        if (assigned >= num_groups) {
+            log_branch(header.running ? CLONE_EVENT_resumed : CLONE_EVENT_unpooled, current_branch, header.parent,
+                       pe->GVT_sig.recv_ts, (int) g_tw_mynode);
+        }
+        if (!header.running) {
+            advance_to_direction(pe, OPTION_second_branch);
+        }
+        my_pe_state = PE_BUSY;
+    }
+}
+
+// The same decisions as the allgather version, taken with the status of the
+// own group only, in this order on every rank:
+// 0. An empty group takes what it was assigned after it went through the
+//    last hook. Its sources wait for it to be received before any global step
+// 1. A finished group starts its next pooled branch, or pushes itself
+// 2. A triggered group claims an empty group for its second branch, and a
+//    group with pooled branches claims empty groups for them. Every member
+//    sends its tile to the same member of the claimed group, and the first
+//    member sends the assignment
+// 3. Rank 0 hands the queries not started yet to empty groups
+// 4. An empty group with an assignment receives it
+// Branches claimed in step 2 and queries in step 3 go to whichever group pops
+// an empty group first
+static void one_sided_allocation(tw_pe *pe, bool branch_done) {
+    int const group_size = g_tiling.group_size;
+    int const num_groups = tw_nnodes() / group_size;
+    int const my_group = search_my_group();
+    int const my_member = search_my_member();
+    tw_stime const gvt = pe->GVT_sig.recv_ts;
+    num_outgoing_assignments = 0;
+
+    // 0. Assignments of the last hook
+    if (my_pe_state == PE_EMPTY) {
+        take_assignment(pe);
+    }
+
+    // Status of the group. The member with the agent is the one that knows
+    int trigger_member = did_this_pe_trigger ? my_member : INT_MAX;
+    bool group_flags[2] = {branch_done, goal_reached};
+    if (group_size > 1) {
+        double const began = hook_stats_begin();
+        MPI_Allreduce(MPI_IN_PLACE, &trigger_member, 1, MPI_INT, MPI_MIN, group_comm);
+        MPI_Allreduce(MPI_IN_PLACE, group_flags, 2, MPI_C_BOOL, MPI_LOR, group_comm);
+        hook_stats_end(HOOK_PHASE_claim, began);
+    }
+    bool const group_triggered = trigger_member != INT_MAX;
+    bool const group_done = group_flags[0];
+
+    // Stopping needs every PE to agree, so it is the one global step left
+    if (g_stop_on_first_goal) {
+        int winner = group_flags[1] ? my_group * group_size : INT_MAX;
+        MPI_Allreduce(MPI_IN_PLACE, &winner, 1, MPI_INT, MPI_MIN, clone_comm);
+        if (winner != INT_MAX) {
+            stop_all_pes(pe, winner);
+            return;
+        }
+    }
+
+    // 1. Finished groups
+    if (group_done) {
+        int const num_pooled = branch_pool_size;
+        recycle_finished_group(pe);
+        if (num_pooled == 0 && my_member == 0) {
+            push_free_group(my_group);
+        }
+    }
+
+    // 2. Claims. Member m of a group only talks to member m of the other group
+    if (group_triggered && group_size > 1) {
+        MPI_Bcast(&current_decision, sizeof(current_decision), MPI_BYTE, trigger_member, group_comm);
+    }
+    if (group_triggered) {
+        uint64_t const child_branch = new_branch_id();
         assert_valid_DecisionInfo(&current_decision);
-        MPI_Send(&current_decision, sizeof(struct DecisionInfo), MPI_BYTE, dest,
-                 0, MPI_COMM_ROSS);
+        int dest_group;
+        if (claim_free_groups(1, &dest_group) == 1) {
+            if (my_member == 0) {
+                printf("Cloning from PE %d to PE %d\n", my_group * group_size, dest_group * group_size);
+            }
+            send_clone(pe, dest_group * group_size + my_member, child_branch);
+            if (my_member == 0) {
+                assign_group(dest_group, my_group);
+            }
+            log_branch(CLONE_EVENT_cloned, child_branch, current_branch, gvt, dest_group * group_size);
+        } else {
+            pool_second_branch(pe, child_branch);
+        }
         advance_to_direction(pe, OPTION_first_branch);
-        did_this_pe_trigger = false;
-    } else {
-        MPI_Status status;
-        MPI_Recv(&current_decision, sizeof(struct DecisionInfo), MPI_BYTE, source,
-                 0, MPI_COMM_ROSS, &status);
-        advance_to_direction(pe, OPTION_second_branch);
+        my_pe_state = PE_BUSY;
+    }
+    if (branch_pool_size > 0) {
+        int dest_groups[BRANCH_POOL_CAPACITY];
+        int const num_claimed = claim_free_groups(branch_pool_size, dest_groups);
+        for (int i = 0; i < num_claimed; i++) {
+            if (my_member == 0) {
+                printf("Cloning from PE %d to PE %d (pooled branch)\n", my_group * group_size, dest_groups[i] * group_size);
+            }
+            send_pooled_branch(pe, dest_groups[i] * group_size + my_member);
+            if (my_member == 0) {
+                assign_group(dest_groups[i], num_groups + my_group);
+            }
+        }
     }
+
+    // 3. Queries, in order
+    if (g_tw_mynode == 0) {
+        while (next_query < g_num_queries) {
+            int const group = pop_free_group();
+            if (group < 0) {
+                break;
+            }
+            assign_group(group, -2 - next_query++);
+        }
+    }
+
+    // 4. Assignments of this hook, if they came already
+    if (my_pe_state == PE_EMPTY) {
+        take_assignment(pe);
+    }
+}
+
+// A branch assigned to this group too late to be installed (after its last
+// hook) is received into the pool, so that its source can complete the
+// transfer and the branch can still be spilled. Queries assigned that late
+// are not started, as with the allgather. Collective over the group, after
+// every rank is done claiming
+static void receive_late_assignment(void) {
+    int const group_size = g_tiling.group_size;
+    int const num_groups = tw_nnodes() / group_size;
+    int const assigned = receive_assignment();
+    if (assigned < 0) {
+        return;
+    }
+    assert(branch_pool_size < BRANCH_POOL_CAPACITY);
+
+    tw_peid const source = (assigned % num_groups) * group_size + search_my_member();
+    struct BranchSnapshot *snapshot = &branch_pool[branch_pool_size++];
+    struct CellDelta const *cells;
+    struct SerializableEvent const *events;
+    receive_branch(source, &snapshot->header, &cells, &events);
+    size_t const states_size = snapshot->header.num_dirty * sizeof(struct CellDelta);
+    size_t const events_size = snapshot->header.num_events * serializable_event_size();
+    snapshot->cells = malloc(states_size > 0 ? states_size : 1);
+    snapshot->events = malloc(events_size > 0 ? events_size : 1);
+    if (!snapshot->cells || !snapshot->events) {
+        tw_error(TW_LOC, "Failed to allocate memory for a pooled branch");
+    }
+    memcpy(snapshot->cells, cells, states_size);
+    memcpy(snapshot->events, events, events_size);
+    snapshot->rngs = pack_lp_rngs(snapshot->cells, snapshot->header.num_dirty);
+    release_received_branch(source, &snapshot->header);
+    assert_valid_BranchSnapshot(snapshot);
+}
+
+// Whether the branch of this group is still going (its agent has not
+// stopped). Collective over the group
+static bool group_branch_running(void) {
+    bool finished = branch_finished;
+    if (g_tiling.group_size > 1) {
+        MPI_Allreduce(MPI_IN_PLACE, &finished, 1, MPI_C_BOOL, MPI_LOR, group_comm);
+    }
+    return my_pe_state != PE_EMPTY && !finished;
+}
+
+// The branch running on this group at the last GVT hook past the end time,
+// for `director_spill_pending` to write
+static struct BranchSnapshot running_snapshot;
+static bool has_running_snapshot = false;
+
+// Keeps the branch running on this group, to go on from where it is in a
+// later run. Called at the end of the hook ROSS runs once GVT is past the end
+// time (`past_end_time`), which is the last one: the hook started with a
+// rollback to GVT and drained the network of the group, and the only events
+// it sent since went to LPs of this rank, so the dirty states and the queue
+// of the PE hold all of the branch. Its own buffers are used, as
+// `state_buffer` and `event_buffer` may be holding a clone sent in this very
+// hook. Collective over the group
+static void capture_running_branch(tw_pe *pe) {
+    if (has_running_snapshot) {
+        free_BranchSnapshot(&running_snapshot);
+        has_running_snapshot = false;
+    }
+    if (!group_branch_running()) {
+        return;
+    }
+    assert(!did_this_pe_trigger);
+
+    double began = hook_stats_begin();
+    struct BranchSnapshot *snapshot = &running_snapshot;
+    snapshot->header = (struct CloneHeader) {
+        .decision = current_origin,
+        .branch = current_branch,
+        .parent = current_parent,
+        .query = g_current_query,
+        .shared_offset = -1,
+        .gvt = pe->GVT_sig.recv_ts,
+        .running = true,
+    };
+    size_t const num_dirty = search_lp_num_dirty();
+    size_t const num_events = tw_pq_get_size(pe->pq);
+    snapshot->cells = malloc((num_dirty > 0 ? num_dirty : 1) * sizeof(struct CellDelta));
+    snapshot->events = malloc((num_events > 0 ? num_events : 1) * serializable_event_size());
+    if (!snapshot->cells || !snapshot->events) {
+        tw_error(TW_LOC, "Failed to allocate memory for the running branch");
+    }
+    snapshot->header.num_dirty = pack_dirty_lp_states(snapshot->cells);
+    snapshot->rngs = pack_lp_rngs(snapshot->cells, snapshot->header.num_dirty);
+    hook_stats_end(HOOK_PHASE_pack_states, began);
+
+    began = hook_stats_begin();
+    snapshot->header.num_events = snapshot_pending_events(pe, snapshot->events);
+    hook_stats_end(HOOK_PHASE_snapshot_events, began);
+    assert_valid_BranchSnapshot(snapshot);
+    has_running_snapshot = true;
 }
 
 void clone_director_gvt_hook(tw_pe *pe, bool past_end_time) {
-    (void)past_end_time; // unused parameter
+    double const hook_began = hook_stats_begin();
+    double began = hook_began;
     tw_scheduler_rollback_and_cancel_events_pe(pe);
+    hook_stats_end(HOOK_PHASE_rollback, began);
+
+    began = hook_stats_begin();
+    if (g_tiling.group_size > 1) {
+        drain_group_network(pe);
+    }
+    complete_outgoing_transfers();
+    hook_stats_end(HOOK_PHASE_network, began);
+
+    // A branch has finished once all the events it left behind (neighbour
+    // notifications) are committed
+    bool const branch_done = branch_finished && pe->GVT_sig.recv_ts > branch_finished_at + CELL_UNAVAILABLE_DELAY;
+    assert(!branch_done || (my_pe_state == PE_BUSY && !did_this_pe_trigger));
+
+    // Branches resumed from disk wait in the pool of groups with nothing running yet
+    if (my_pe_state == PE_EMPTY && branch_pool_size > 0) {
+        start_pooled_branch(pe);
+    }
 
     // Update my state based on whether I triggered this hook call
     if (did_this_pe_trigger) {
         my_pe_state = PE_REQUEST_CLONING;
     }
 
+    if (g_one_sided_allocation) {
+        one_sided_allocation(pe, branch_done);
+        refill_pool_from_disk(pe);
+        did_this_pe_trigger = false;
+        if (past_end_time && spill_dir) {
+            capture_running_branch(pe);
+        }
+        hook_stats_hook_done(hook_began);
+        return;
+    }
+
     // Gather states from all PEs to get global view
     int world_size = tw_nnodes();
-    enum PE_STATE all_pe_states[world_size];
+    struct PeStatus my_status = {
+        .state = my_pe_state,
+        .num_pooled = branch_pool_size,
+        .goal_reached = goal_reached,
+        .branch_done = branch_done,
+    };
+    struct PeStatus all_pe_status[world_size];
 
-    MPI_Allgather(&my_pe_state, 1, MPI_INT, &all_pe_states, 1, MPI_INT, MPI_COMM_ROSS);
+    began = hook_stats_begin();
+    MPI_Allgather(&my_status, sizeof(struct PeStatus), MPI_BYTE,
+                  all_pe_status, sizeof(struct PeStatus), MPI_BYTE, MPI_COMM_ROSS);
+    hook_stats_end(HOOK_PHASE_allgather, began);
 
-    // Find source (requesting) and destination (empty) PEs
-    int source_pe = -1, dest_pe = -1;
+    // Cloning happens between whole groups, with groups of one rank being
+    // the same as cloning between PEs
+    int const group_size = g_tiling.group_size;
+    int const num_groups = world_size / group_size;
+    int const my_group = search_my_group();
+    int const my_member = search_my_member();
+    struct GroupStatus groups[num_groups];
+    summarize_groups(all_pe_status, groups, num_groups);
 
-    for (int pe_id = 0; pe_id < world_size; pe_id++) {
-        if (all_pe_states[pe_id] == PE_REQUEST_CLONING) {
-            assert(source_pe == -1);
-            source_pe = pe_id;
+    if (g_stop_on_first_goal) {
+        for (int group = 0; group < num_groups; group++) {
+            if (groups[group].goal_reached) {
+                stop_all_pes(pe, group * group_size);
+                hook_stats_hook_done(hook_began);
+                return;
+            }
         }
-        if (all_pe_states[pe_id] == PE_EMPTY && dest_pe == -1) {
-            dest_pe = pe_id;  // First empty PE found
+    }
+
+    // Groups whose branch has finished go back to the empty pool, or start
+    // their oldest pooled branch. Every PE updates its copy of the table
+    if (groups[my_group].branch_done) {
+        recycle_finished_group(pe);
+    }
+    for (int group = 0; group < num_groups; group++) {
+        if (groups[group].branch_done) {
+            if (groups[group].num_pooled > 0) {
+                groups[group].num_pooled--;
+                groups[group].state = PE_BUSY;
+            } else {
+                groups[group].state = PE_EMPTY;
+            }
         }
     }
 
-    // Execute cloning if both source and destination found
-    if (source_pe != -1 && dest_pe != -1) {
-        if ((int)g_tw_mynode == source_pe) {
-            printf("Cloning from PE %d to PE %d\n", source_pe, dest_pe);
+    // Only the member that triggered the hook knows the decision. The second
+    // direction of the decision becomes a new branch
+    bool const group_triggered = groups[my_group].state == PE_REQUEST_CLONING;
+    if (group_triggered && group_size > 1) {
+        MPI_Bcast(&current_decision, sizeof(current_decision), MPI_BYTE,
+                  groups[my_group].trigger_member, group_comm);
+    }
+    uint64_t const child_branch = group_triggered ? new_branch_id() : BRANCH_NONE;
+
+    // Every group requesting to be cloned is paired with a distinct empty
+    // group. The i-th requesting group (in rank order) gets the i-th empty
+    // group. All PEs see the same states, so they all agree on the pairing
+    // without further communication. Pairs are disjoint, so their transfers
+    // run concurrently
+    int num_requesting = 0, num_empty = 0;
+    int requesting_groups[num_groups], empty_groups[num_groups];
+
+    for (int group = 0; group < num_groups; group++) {
+        if (groups[group].state == PE_REQUEST_CLONING) {
+            requesting_groups[num_requesting++] = group;
+        } else if (groups[group].state == PE_EMPTY) {
+            empty_groups[num_empty++] = group;
         }
-        clone_branch_and_advance(pe, source_pe, dest_pe);
+    }
+    int const num_pairs = num_requesting < num_empty ? num_requesting : num_empty;
 
-        // Update states after successful cloning
-        if ((int)g_tw_mynode == source_pe || (int)g_tw_mynode == dest_pe) {
+    // Empty groups left over steal pooled branches, oldest first, going over
+    // the pools in rank order. `sources[i]` is the group sending a branch to
+    // `empty_groups[i]`
+    int sources[num_groups];
+    int num_assigned = num_pairs;
+    for (int i = 0; i < num_pairs; i++) {
+        sources[i] = requesting_groups[i];
+    }
+    for (int group = 0; group < num_groups && num_assigned < num_empty; group++) {
+        for (int k = 0; k < groups[group].num_pooled && num_assigned < num_empty; k++) {
+            sources[num_assigned++] = group;
+        }
+    }
+
+    // All sends are posted before any (blocking) receive, so no two PEs can
+    // end up waiting on each other. Member m of a group only talks to member
+    // m of the other group
+    bool cloned = false;
+    for (int i = 0; i < num_assigned; i++) {
+        if (sources[i] != my_group) {
+            continue;
+        }
+        if (my_member == 0) {
+            printf("Cloning from PE %d to PE %d%s\n", sources[i] * group_size, empty_groups[i] * group_size,
+                   i < num_pairs ? "" : " (pooled branch)");
+        }
+        if (i < num_pairs) {
+            assert(group_triggered);
+            assert_valid_DecisionInfo(&current_decision);
+            send_clone(pe, empty_groups[i] * group_size + my_member, child_branch);
+            log_branch(CLONE_EVENT_cloned, child_branch, current_branch, pe->GVT_sig.recv_ts,
+                       empty_groups[i] * group_size);
+            cloned = true;
+        } else {
+            send_pooled_branch(pe, empty_groups[i] * group_size + my_member);
+        }
+    }
+    for (int i = 0; i < num_assigned; i++) {
+        if (empty_groups[i] == my_group) {
+            struct CloneHeader header;
+            receive_clone(pe, sources[i] * group_size + my_member, &header);
+            if (i >= num_pairs) {
+                log_branch(header.running ? CLONE_EVENT_resumed : CLONE_EVENT_unpooled, current_branch,
+                           header.parent, pe->GVT_sig.recv_ts, (int) g_tw_mynode);
+            }
+            if (!header.running) {
+                advance_to_direction(pe, OPTION_second_branch);
+            }
             my_pe_state = PE_BUSY;
         }
-    } else if (did_this_pe_trigger) {
-        // No empty PEs available, continue simulation normally on this PE
-        assert_valid_DecisionInfo(&current_decision);
+    }
+
+    // Groups still empty start the queries nobody has started yet, in order.
+    // Branches of queries already running go first, so earlier queries finish
+    // before later ones start
+    for (int i = num_assigned; i < num_empty && next_query < g_num_queries; i++) {
+        if (empty_groups[i] == my_group) {
+            start_query(pe, next_query);
+        }
+        next_query++;
+    }
+
+    if (group_triggered) {
+        if (!cloned) {
+            // No empty groups available, the second branch waits in the pool
+            // and this group continues simulating the first one
+            pool_second_branch(pe, child_branch);
+        }
         advance_to_direction(pe, OPTION_first_branch);
         my_pe_state = PE_BUSY;
-        //did_this_pe_trigger = false;
     }
 
+    refill_pool_from_disk(pe);
     did_this_pe_trigger = false;
+    if (past_end_time && spill_dir) {
+        capture_running_branch(pe);
+    }
+    hook_stats_hook_done(hook_began);
+}
+
+void director_write_final_output(void) {
+    if (g_one_sided_allocation) {
+        MPI_Barrier(clone_comm);
+        if (my_pe_state == PE_EMPTY) {
+            receive_late_assignment();
+        }
+    }
+    // Branches that go on in a later run are recorded once they finish there
+    results_gather(group_comm);
+    if (search_my_member() == 0) {
+        if (my_pe_state != PE_EMPTY && !has_running_snapshot) {
+            query_record_branch(g_current_query, result_was_visited(g_goal_x, g_goal_y));
+        }
+        write_final_output(my_pe_state != PE_EMPTY);
+    }
+}
+
+void director_spill_pending(void) {
+    if (!spill_dir) {
+        return;
+    }
+    // The running branch was captured in the last GVT hook (see
+    // `capture_running_branch`)
+    bool const running = has_running_snapshot;
+    if (running) {
+        write_spill_file(&running_snapshot.header, running_snapshot.cells, running_snapshot.rngs,
+                         running_snapshot.events);
+        log_branch(CLONE_EVENT_suspended, current_branch, current_parent, running_snapshot.header.gvt,
+                   search_my_group() * g_tiling.group_size);
+        free_BranchSnapshot(&running_snapshot);
+        has_running_snapshot = false;
+    } else if (group_branch_running() && search_my_member() == 0) {
+        printf("PE %d - No GVT hook ran past the end time, the running branch is not kept\n", (int) g_tw_mynode);
+    }
+    for (int i = 0; i < branch_pool_size; i++) {
+        write_spill_file(&branch_pool[i].header, branch_pool[i].cells, branch_pool[i].rngs, branch_pool[i].events);
+        free_BranchSnapshot(&branch_pool[i]);
+    }
+    // Resumed branches that never left the resume directory move to the spill one
+    bool const same_dir = strcmp(spill_dir, resume_dir ? resume_dir : "") == 0;
+    for (int i = 0; i < num_spilled_branches; i++) {
+        if (spilled_branches[i].resumed && !same_dir) {
+            struct BranchSnapshot snapshot;
+            read_spill_file(resume_dir, spilled_branches[i].branch, &snapshot);
+            write_spill_file(&snapshot.header, snapshot.cells, snapshot.rngs, snapshot.events);
+            free_BranchSnapshot(&snapshot);
+        }
+    }
+
+    int num_pending = search_my_member() == 0 ? branch_pool_size + num_spilled_branches + running : 0;
+    MPI_Allreduce(MPI_IN_PLACE, &num_pending, 1, MPI_INT, MPI_SUM, clone_comm);
+    if (g_tw_mynode == 0) {
+        printf("%d pending branches left in %s\n", num_pending, spill_dir);
+    }
+    branch_pool_size = 0;
+    num_spilled_branches = 0;
 }
 
 void director_finalize(void) {
+    complete_outgoing_transfers();
+    for (int i = 0; i < branch_pool_size; i++) {
+        free_BranchSnapshot(&branch_pool[i]);
+    }
+    branch_pool_size = 0;
+    free(spilled_branches);
+    spilled_branches = NULL;
+    num_spilled_branches = 0;
+    spilled_branches_capacity = 0;
+    free(outgoing_requests);
+    outgoing_requests = NULL;
+    outgoing_requests_capacity = 0;
+    if (group_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&group_comm);
+    }
+    allocation_window_free();
+    shared_transport_free();
+    if (clone_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&clone_comm);
+    }
+    free(event_buffer);
+    event_buffer = NULL;
+    event_buffer_capacity = 0;
+    free(state_buffer);
+    state_buffer = NULL;
+    state_buffer_size = 0;
 }
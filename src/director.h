@@ -12,13 +12,52 @@
 /** GVT hook function - called when triggered from model */
 void clone_director_gvt_hook(tw_pe *pe, bool past_end_time);
 
+/** Configure the director. With `stop_on_first_goal`, all PEs stop as soon
+ * as one of them finds the goal. With `one_sided_allocation`, groups claim
+ * empty groups through an MPI window instead of all PEs sharing their status
+ * in every GVT hook. Clones to PEs of the same node go through a shared
+ * segment of `shared_segment_bytes` per PE (none if 0) when they fit in it.
+ * Branches that do not fit in the pool are written to `spill_dir` instead of
+ * being dropped (NULL to drop them). With `resume_dir`, the run starts from
+ * the branches left there by an earlier run instead of from the queries, and
+ * spills to it if `spill_dir` is NULL. Must be called before `director_init`. */
+void director_config(bool stop_on_first_goal, bool one_sided_allocation, size_t shared_segment_bytes,
+                     char const *spill_dir, char const *resume_dir);
+
+/** Whether the run resumes branches from disk (no agent starts on its own). */
+bool director_is_resuming(void);
+
 /** Initialize the director module */
 void director_init(void);
 
-/** Store decision information for later printing via GVT hook */
-void director_store_decision(int x, int y, enum DIRECTION chosen_dir, enum DIRECTION second_dir, tw_stime timestamp);
+/** Store decision information for later printing via GVT hook. `trail` is
+ * NULL unless the agent carries its visited cells */
+void director_store_decision(int x, int y, enum DIRECTION chosen_dir, enum DIRECTION second_dir, tw_stime timestamp,
+                             struct AgentTrail const *trail);
 void director_store_decision_rev(int x, int y);
 
+/** Informs the director that the agent reached the goal (called from the
+ * forward handler), and its reverse. */
+void director_goal_reached(tw_lp *lp);
+void director_goal_reached_rev(tw_lp *lp);
+
+/** Informs the director that the agent of the branch running on this PE
+ * stopped (goal found or stuck) at time `at`. Only to be called from commit
+ * handlers, as it cannot be reversed. */
+void director_branch_finished(tw_stime at);
+
+/** Writes the results of the branch running on the group of this PE (if any)
+ * once the simulation is over. With a spill directory, a branch that has not
+ * finished is left out of the query summary, as it goes on in a later run.
+ * Collective (over the group without one-sided allocation), only the first
+ * member of the group writes the file. */
+void director_write_final_output(void);
+
+/** Writes the branches still waiting in the pools, and the ones that were
+ * running when the simulation ended, to the spill directory (if any), next
+ * to the ones already spilled, for a later run to resume them. Collective. */
+void director_spill_pending(void);
+
 /** Cleanup the director module */
 void director_finalize(void);
 
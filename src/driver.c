@@ -1,6 +1,11 @@
 #include "driver.h"
+#include "generator.h"
+#include "grid_map.h"
+#include "query.h"
 #include "ross-extern.h"
 #include "state.h"
+#include "utils.h"
+#include <inttypes.h>
 #include <stdbool.h>
 #include <ross.h>
 #include <stdio.h>
@@ -11,125 +16,89 @@
 
 static char *g_grid_map_file = NULL;
 
-void driver_config(const char *grid_map_file) {
+// Grid to build when no grid map file is given
+static struct GridGenParams g_grid_gen;
+
+// Whether to build the corridor plane
+static bool g_corridor_skip = false;
+
+// Whether branch results are kept in memory and written to a single file at
+// the end instead of one file per PE
+static bool g_aggregate_output = false;
+
+// Number of branches whose results have been written by this PE
+static int num_branches_written = 0;
+
+// Records of the branches of this PE, one line each (aggregated output only)
+static char *records = NULL;
+static size_t records_size = 0;
+static size_t records_capacity = 0;
+
+void driver_config(const char *grid_map_file, struct GridGenParams const *grid_gen, bool corridor_skip,
+                   bool aggregate_output) {
+    g_corridor_skip = corridor_skip;
+    g_aggregate_output = aggregate_output;
     if (g_grid_map_file) {
         free(g_grid_map_file);
+        g_grid_map_file = NULL;
+    }
+    if (grid_map_file) {
+        g_grid_map_file = strdup(grid_map_file);
+    } else {
+        assert(grid_gen);
+        g_grid_gen = *grid_gen;
     }
-    g_grid_map_file = strdup(grid_map_file);
 }
 
 
-// ================================= Grid file parsing ===============================
+// ================================= Grid loading ===============================
 
-static int parse_grid_file(const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open grid file '%s'\n", filename);
+int driver_init(void) {
+    // Only rank 0 reads (or builds) the grid
+    int load_status = 0;
+    if (g_tw_mynode == 0) {
+        load_status = g_grid_map_file ? grid_map_load(g_grid_map_file) : generate_grid(&g_grid_gen);
+    }
+    if (grid_map_share(load_status, MPI_COMM_ROSS) != 0) {
         return -1;
     }
 
-    char line[256];
-
-    // Skip comments and find dimensions
-    while (fgets(line, sizeof(line), fp)) {
-        if (line[0] == '/' && line[1] == '/') continue;
-        if (sscanf(line, "%d %d", &g_grid_width, &g_grid_height) == 2) {
-            break;
+    // Start and goal need an LP, and only free cells have one
+    if (grid_is_obstacle(g_start_x, g_start_y) || grid_is_obstacle(g_goal_x, g_goal_y)) {
+        if (g_tw_mynode == 0) {
+            fprintf(stderr, "Error: Start (%d,%d) and goal (%d,%d) cannot be obstacles\n",
+                    g_start_x, g_start_y, g_goal_x, g_goal_y);
         }
-    }
-
-    if (g_grid_width <= 0 || g_grid_height <= 0 ||
-        g_grid_width > MAX_GRID_WIDTH || g_grid_height > MAX_GRID_HEIGHT) {
-        fprintf(stderr, "Error: Invalid grid dimensions %dx%d\n", g_grid_width, g_grid_height);
-        fclose(fp);
         return -1;
     }
-
-    // Allocate global grids
-    int total_cells = g_grid_width * g_grid_height;
-    g_initial_grid = calloc(total_cells, sizeof(enum CELL_TYPE));
-    g_visited_grid = calloc(total_cells, sizeof(bool));
-    g_exit_dirs = calloc(total_cells, sizeof(enum DIRECTION));
-
-    if (!g_initial_grid || !g_visited_grid || !g_exit_dirs) {
-        fprintf(stderr, "Error: Failed to allocate grid memory\n");
-        fclose(fp);
+    if (grid_map_index_free_cells() != 0) {
         return -1;
     }
-
-    // Initialize exit directions to DIR_NONE
-    for (int i = 0; i < total_cells; i++) {
-        g_exit_dirs[i] = DIRECTION_none;
-    }
-
-    // Parse grid content
-    int y = 0;
-    while (fgets(line, sizeof(line), fp) && y < g_grid_height) {
-        if (line[0] == '/' && line[1] == '/') continue;
-
-        int x = 0;
-        for (char *p = line; *p && x < g_grid_width; p++) {
-            if (*p == ' ' || *p == '\t') continue;
-
-            enum CELL_TYPE cell_type = CELL_TYPE_free;
-            switch (*p) {
-                case '.': cell_type = CELL_TYPE_free; break;
-                case '#': cell_type = CELL_TYPE_obstacle; break;
-                case 'S':
-                    cell_type = CELL_TYPE_start;
-                    g_start_x = x;
-                    g_start_y = y;
-                    break;
-                case 'G':
-                    cell_type = CELL_TYPE_goal;
-                    g_goal_x = x;
-                    g_goal_y = y;
-                    break;
-                default:
-                    if (*p != '\n' && *p != '\r') {
-                        fprintf(stderr, "Warning: Unknown character '%c' at (%d,%d), treating as free\n", *p, x, y);
-                    }
-                    continue;
-            }
-
-            g_initial_grid[grid_index(x, y)] = cell_type;
-            x++;
-        }
-        y++;
-    }
-
-    fclose(fp);
-
-    // Validate start and goal positions
-    if (g_start_x < 0 || g_start_y < 0) {
-        fprintf(stderr, "Error: No start position 'S' found in grid\n");
+    if (g_corridor_skip && grid_map_index_corridors() != 0) {
         return -1;
     }
-    if (g_goal_x < 0 || g_goal_y < 0) {
-        fprintf(stderr, "Error: No goal position 'G' found in grid\n");
+
+    // Results (result pages are only allocated on use)
+    if (results_init() != 0) {
+        fprintf(stderr, "Error: Failed to allocate grid memory (%zu cells)\n", grid_num_cells());
         return -1;
     }
 
     if (g_tw_mynode == 0) {
-        printf("Grid loaded: %dx%d, start=(%d,%d), goal=(%d,%d)\n",
-               g_grid_width, g_grid_height, g_start_x, g_start_y, g_goal_x, g_goal_y);
+        printf("Grid loaded: %dx%d (%zu free cells), start=(%d,%d), goal=(%d,%d)\n",
+               g_grid_width, g_grid_height, g_num_free_cells, g_start_x, g_start_y, g_goal_x, g_goal_y);
     }
 
     return 0;
 }
 
-int driver_init(void) {
-    if (!g_grid_map_file) {
-        fprintf(stderr, "Error: No grid map file specified\n");
-        return -1;
-    }
-    return parse_grid_file(g_grid_map_file);
-}
-
 void driver_finalize(void) {
-    if (g_initial_grid) { free(g_initial_grid); g_initial_grid = NULL; }
-    if (g_visited_grid) { free(g_visited_grid); g_visited_grid = NULL; }
-    if (g_exit_dirs) { free(g_exit_dirs); g_exit_dirs = NULL; }
+    grid_map_free();
+    results_free();
+    free(records);
+    records = NULL;
+    records_size = 0;
+    records_capacity = 0;
     if (g_grid_map_file) { free(g_grid_map_file); g_grid_map_file = NULL; }
 }
 
@@ -149,14 +118,14 @@ static const char* line_chars[5][5] = {
 };
 
 static enum DIRECTION get_entry_direction(int x, int y) {
-    if (is_valid_position(x, y-1) && g_visited_grid[grid_index(x, y-1)] &&
-        g_exit_dirs[grid_index(x, y-1)] == DIRECTION_south) return DIRECTION_north;
-    if (is_valid_position(x, y+1) && g_visited_grid[grid_index(x, y+1)] &&
-        g_exit_dirs[grid_index(x, y+1)] == DIRECTION_north) return DIRECTION_south;
-    if (is_valid_position(x-1, y) && g_visited_grid[grid_index(x-1, y)] &&
-        g_exit_dirs[grid_index(x-1, y)] == DIRECTION_east) return DIRECTION_west;
-    if (is_valid_position(x+1, y) && g_visited_grid[grid_index(x+1, y)] &&
-        g_exit_dirs[grid_index(x+1, y)] == DIRECTION_west) return DIRECTION_east;
+    if (is_valid_position(x, y-1) && result_was_visited(x, y-1) &&
+        result_exit_dir(x, y-1) == DIRECTION_south) return DIRECTION_north;
+    if (is_valid_position(x, y+1) && result_was_visited(x, y+1) &&
+        result_exit_dir(x, y+1) == DIRECTION_north) return DIRECTION_south;
+    if (is_valid_position(x-1, y) && result_was_visited(x-1, y) &&
+        result_exit_dir(x-1, y) == DIRECTION_east) return DIRECTION_west;
+    if (is_valid_position(x+1, y) && result_was_visited(x+1, y) &&
+        result_exit_dir(x+1, y) == DIRECTION_west) return DIRECTION_east;
     return DIRECTION_none;
 }
 
@@ -170,30 +139,155 @@ static const bool connects_to_the_right[5][5] = {
 };
 #endif
 
-void write_final_output(void) {
-    if (!g_visited_grid || !g_exit_dirs) return;
+// ================================= Aggregated output ================================
+
+// Follows the exit directions from the start, one letter (NSEW) per step
+// written to `path` if not NULL, until the cell the agent left in no
+// direction: the goal, or where it got stuck. That cell is returned in
+// `end_x`/`end_y`. Returns the number of steps
+static size_t trace_path(char *path, int *end_x, int *end_y) {
+    static char const letters[] = "NSEW";
+    int const dx[] = {0, 0, 1, -1};
+    int const dy[] = {-1, 1, 0, 0};
+    int x = g_start_x, y = g_start_y;
+    size_t steps = 0;
+    while (result_was_visited(x, y) && steps < g_num_free_cells) {
+        enum DIRECTION const dir = result_exit_dir(x, y);
+        if (dir == DIRECTION_none || !is_valid_position(x + dx[dir], y + dy[dir])
+            || !result_was_visited(x + dx[dir], y + dy[dir])) {
+            break;
+        }
+        if (path) {
+            path[steps] = letters[dir];
+        }
+        x += dx[dir];
+        y += dy[dir];
+        steps++;
+    }
+    *end_x = x;
+    *end_y = y;
+    return steps;
+}
+
+// Appends the record of the branch that has just finished to `records`
+static void append_branch_record(void) {
+    int end_x, end_y;
+    size_t const steps = trace_path(NULL, &end_x, &end_y);
+
+    // Longest possible fixed part of a record, plus the path and its newline
+    size_t const needed = records_size + 160 + steps + 1;
+    if (needed > records_capacity) {
+        size_t const new_capacity = needed > 2 * records_capacity ? needed : 2 * records_capacity;
+        char *grown = realloc(records, new_capacity);
+        if (!grown) {
+            tw_error(TW_LOC, "Failed to allocate %zu bytes of branch records", new_capacity);
+        }
+        records = grown;
+        records_capacity = new_capacity;
+    }
+
+    records_size += sprintf(records + records_size, "%d %d %d %d %d %d %d %d %d %d %zu ",
+                            (int) g_tw_mynode, num_branches_written, g_current_query,
+                            g_start_x, g_start_y, g_goal_x, g_goal_y,
+                            result_was_visited(g_goal_x, g_goal_y) ? 1 : 0, end_x, end_y, steps);
+    trace_path(records + records_size, &end_x, &end_y);
+    records_size += steps;
+    records[records_size++] = '\n';
+}
+
+static char const records_header[] =
+    "# pe branch query start_x start_y goal_x goal_y goal_reached end_x end_y steps path\n";
+
+int write_aggregated_output(MPI_Comm comm) {
+    assert(g_aggregate_output);
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    // Only ranks holding records take part in the write. Rank 0 always does,
+    // as it writes the header and the index
+    MPI_Comm writers;
+    MPI_Comm_split(comm, num_branches_written > 0 || rank == 0 ? 0 : MPI_UNDEFINED, rank, &writers);
+    if (writers == MPI_COMM_NULL) {
+        return 0;
+    }
+    int writer, num_writers;
+    MPI_Comm_rank(writers, &writer);
+    MPI_Comm_size(writers, &num_writers);
+
+    uint64_t offset;
+    int const status = write_rank_ordered_file(writers, "search-results.txt", records_header,
+                                               records, records_size, &offset);
+
+    // Index: where the records of every rank start, and how many there are
+    uint64_t const my_entry[4] = {g_tw_mynode, num_branches_written, offset, records_size};
+    uint64_t *index = NULL;
+    if (writer == 0) {
+        index = malloc(num_writers * sizeof(my_entry));
+        if (!index) {
+            tw_error(TW_LOC, "Failed to allocate the index of %d ranks", num_writers);
+        }
+    }
+    MPI_Gather(my_entry, 4, MPI_UINT64_T, index, 4, MPI_UINT64_T, 0, writers);
+    MPI_Comm_free(&writers);
+
+    if (writer == 0) {
+        FILE *fp = status == 0 ? fopen("search-results.idx", "w") : NULL;
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot create the index of the aggregated output\n");
+        } else {
+            fprintf(fp, "# pe branches offset bytes\n");
+            for (int i = 0; i < num_writers; i++) {
+                if (index[4 * i + 1] > 0) {
+                    fprintf(fp, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                            index[4 * i], index[4 * i + 1], index[4 * i + 2], index[4 * i + 3]);
+                }
+            }
+            fclose(fp);
+            printf("Results of all branches written to search-results.txt (index in search-results.idx)\n");
+        }
+        free(index);
+    }
+    return status;
+}
 
+// ================================= Per PE output ================================
+
+void write_branch_output(void) {
+    if (!g_obstacle_plane) return;
+    if (g_aggregate_output) {
+        append_branch_record();
+        num_branches_written++;
+        return;
+    }
+
+    // The first branch creates the file, any other branch run on this PE is appended to it
     char filename[256];
     snprintf(filename, sizeof(filename), "search-results-pe=%d.txt", (int) g_tw_mynode);
-    FILE *fp = fopen(filename, "w");
+    FILE *fp = fopen(filename, num_branches_written == 0 ? "w" : "a");
     if (!fp) {
         fprintf(stderr, "Error: Cannot create output file\n");
         return;
     }
 
-    fprintf(fp, "Search Results on PE %d\n", (int) g_tw_mynode);
+    if (num_branches_written == 0) {
+        fprintf(fp, "Search Results on PE %d\n", (int) g_tw_mynode);
+    } else {
+        fprintf(fp, "\nSearch Results on PE %d, branch %d\n", (int) g_tw_mynode, num_branches_written);
+    }
     fprintf(fp, "Grid size: %dx%d\n", g_grid_width, g_grid_height);
+    if (g_num_queries > 1) {
+        fprintf(fp, "Query: %d\n", g_current_query);
+    }
     fprintf(fp, "Start: (%d,%d), Goal: (%d,%d)\n", g_start_x, g_start_y, g_goal_x, g_goal_y);
-    fprintf(fp, "Goal reached: %s\n", g_visited_grid[grid_index(g_goal_x, g_goal_y)] ? "YES" : "NO");
+    fprintf(fp, "Goal reached: %s\n", result_was_visited(g_goal_x, g_goal_y) ? "YES" : "NO");
     fprintf(fp, "\nGrid visualization:\n");
 
     // Pretty print the grid with directional arrows
     for (int y = 0; y < g_grid_height; y++) {
         for (int x = 0; x < g_grid_width; x++) {
-            int idx = grid_index(x, y);
-            enum CELL_TYPE cell_type = g_initial_grid[idx];
-            bool visited = g_visited_grid[idx];
-            enum DIRECTION exit_dir = g_exit_dirs[idx];
+            enum CELL_TYPE cell_type = grid_cell_type(x, y);
+            bool visited = result_was_visited(x, y);
+            enum DIRECTION exit_dir = result_exit_dir(x, y);
 
             if (cell_type == CELL_TYPE_obstacle) {
                 fprintf(fp, "# ");
@@ -229,8 +323,16 @@ void write_final_output(void) {
     }
 
     fclose(fp);
+    num_branches_written++;
     printf("Results written to %s\n", filename);
 }
 
+void write_final_output(bool branch_running) {
+    // Aggregated output skips PEs that never ran a branch
+    if (branch_running || (num_branches_written == 0 && !g_aggregate_output)) {
+        write_branch_output();
+    }
+}
+
 
 
@@ -1,21 +1,45 @@
 #ifndef SEARCH_DRIVER_H
 #define SEARCH_DRIVER_H
 
+#include "generator.h"
+#include <mpi.h>
+#include <stdbool.h>
+
 /** @file
  * Functions implementing search algorithm as PDES in ROSS.
  */
 
-/** Setting grid map file for the simulation. */
-void driver_config(const char *grid_map_file);
+/** Setting the grid for the simulation: either the grid map file or, if
+ * `grid_map_file` is NULL, the parameters of the grid to generate. With
+ * `corridor_skip`, agents go through corridors in a single event (see
+ * `g_corridor_plane`). With `aggregate_output`, branch results are
+ * kept in memory and written by `write_aggregated_output` instead of one
+ * file per PE. */
+void driver_config(const char *grid_map_file, struct GridGenParams const *grid_gen, bool corridor_skip,
+                   bool aggregate_output);
 
-/** Initialize the driver (parse grid file). */
+/** Initialize the driver (rank 0 parses the grid file, or generates the grid,
+ * and shares it with every other rank). Collective. */
 int driver_init(void);
 
 /** Clean up driver resources. */
 void driver_finalize(void);
 
-/** Write final results to output file. */
-void write_final_output(void);
+/** Append the results of the branch that has just finished (as stored in the
+ * global grids) to the output file of this PE, or to its records with
+ * aggregated output. */
+void write_branch_output(void);
+
+/** Write final results to output file. The results of the running branch are
+ * written, if any. A PE that never ran a branch still writes its (empty) grid,
+ * except with aggregated output. */
+void write_final_output(bool branch_running);
+
+/** Writes the records of all branches to `search-results.txt` with MPI-IO,
+ * one line per branch (its path as NSEW steps from the start), and an index
+ * of where the records of every PE start to `search-results.idx`. Ranks that
+ * ran no branch do not open the file. Returns 0 on success. Collective. */
+int write_aggregated_output(MPI_Comm comm);
 
 
 #endif /* SEARCH_DRIVER_H */
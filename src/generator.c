@@ -0,0 +1,256 @@
+#include "generator.h"
+#include "grid_map.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ================================= Random numbers ================================
+
+// SplitMix64, small and fast, and the same sequence on every platform
+struct GenRng {
+  uint64_t state;
+};
+
+static uint64_t rng_next(struct GenRng *rng) {
+    uint64_t z = (rng->state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double rng_unif(struct GenRng *rng) {
+    return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+// Uniform in [0, n)
+static int rng_below(struct GenRng *rng, int n) {
+    return (int) (rng_next(rng) % (uint64_t) n);
+}
+
+
+// ================================= Plane helpers ================================
+
+static void set_obstacle(uint64_t *plane, int x, int y, bool obstacle) {
+    size_t const idx = grid_index(x, y);
+    if (obstacle) {
+        plane[idx / 64] |= UINT64_C(1) << (idx % 64);
+    } else {
+        plane[idx / 64] &= ~(UINT64_C(1) << (idx % 64));
+    }
+}
+
+static void fill_obstacles(uint64_t *plane) {
+    memset(plane, 0xFF, grid_plane_words() * sizeof(*plane));
+}
+
+
+// ================================= Parameters ================================
+
+bool is_valid_GridGenParams(struct GridGenParams const *params) {
+    int const min_side = params->kind == GRID_KIND_maze ? 3
+                       : params->kind == GRID_KIND_rooms ? ROOMS_TILE_SIZE : 1;
+    return params->kind >= GRID_KIND_open && params->kind <= GRID_KIND_rooms
+        && params->width >= min_side && params->width <= MAX_GRID_WIDTH
+        && params->height >= min_side && params->height <= MAX_GRID_HEIGHT
+        && params->density >= 0 && params->density <= 1;
+}
+
+void assert_valid_GridGenParams(struct GridGenParams const *params) {
+#ifndef NDEBUG
+    assert(params->kind >= GRID_KIND_open && params->kind <= GRID_KIND_rooms);
+    int const min_side = params->kind == GRID_KIND_maze ? 3
+                       : params->kind == GRID_KIND_rooms ? ROOMS_TILE_SIZE : 1;
+    assert(params->width >= min_side && params->width <= MAX_GRID_WIDTH);
+    assert(params->height >= min_side && params->height <= MAX_GRID_HEIGHT);
+    assert(params->density >= 0 && params->density <= 1);
+#endif
+}
+
+bool grid_kind_from_name(char const *name, enum GRID_KIND *kind) {
+    static struct { char const *name; enum GRID_KIND kind; } const kinds[] = {
+        {"open", GRID_KIND_open},
+        {"random", GRID_KIND_random},
+        {"maze", GRID_KIND_maze},
+        {"rooms", GRID_KIND_rooms},
+    };
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        if (strcmp(name, kinds[i].name) == 0) {
+            *kind = kinds[i].kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// ================================= Generators ================================
+
+// Start and goal in opposite corners, both kept free
+static void generate_random(uint64_t *plane, double density, struct GenRng *rng) {
+    for (int y = 0; y < g_grid_height; y++) {
+        for (int x = 0; x < g_grid_width; x++) {
+            set_obstacle(plane, x, y, rng_unif(rng) < density);
+        }
+    }
+    g_start_x = 0;
+    g_start_y = 0;
+    g_goal_x = g_grid_width - 1;
+    g_goal_y = g_grid_height - 1;
+    set_obstacle(plane, g_start_x, g_start_y, false);
+    set_obstacle(plane, g_goal_x, g_goal_y, false);
+}
+
+// Maze cells sit at odd coordinates, with walls in between. The unvisited
+// maze cells are exactly the ones still marked as obstacles, and the
+// backtracking stack is explicit, so big mazes don't overflow the C stack
+static int generate_maze(uint64_t *plane, struct GenRng *rng) {
+    int const maze_w = (g_grid_width - 1) / 2;
+    int const maze_h = (g_grid_height - 1) / 2;
+    size_t *stack = malloc((size_t) maze_w * maze_h * sizeof(*stack));
+    if (!stack) {
+        fprintf(stderr, "Error: Failed to allocate maze generation stack\n");
+        return -1;
+    }
+
+    fill_obstacles(plane);
+    int const dx[] = {0, 0, 1, -1};
+    int const dy[] = {-1, 1, 0, 0};
+
+    size_t top = 0;
+    stack[top++] = 0;
+    set_obstacle(plane, 1, 1, false);
+    while (top > 0) {
+        size_t const cell = stack[top - 1];
+        int const cx = cell % maze_w;
+        int const cy = cell / maze_w;
+
+        int options[4];
+        int num_options = 0;
+        for (int i = 0; i < 4; i++) {
+            int const nx = cx + dx[i];
+            int const ny = cy + dy[i];
+            if (nx >= 0 && nx < maze_w && ny >= 0 && ny < maze_h
+                && grid_is_obstacle(2 * nx + 1, 2 * ny + 1)) {
+                options[num_options++] = i;
+            }
+        }
+
+        if (num_options == 0) {
+            top--;
+            continue;
+        }
+        int const dir = options[rng_below(rng, num_options)];
+        int const nx = cx + dx[dir];
+        int const ny = cy + dy[dir];
+        set_obstacle(plane, 2 * cx + 1 + dx[dir], 2 * cy + 1 + dy[dir], false);
+        set_obstacle(plane, 2 * nx + 1, 2 * ny + 1, false);
+        stack[top++] = (size_t) ny * maze_w + nx;
+    }
+    free(stack);
+
+    g_start_x = 1;
+    g_start_y = 1;
+    g_goal_x = 2 * maze_w - 1;
+    g_goal_y = 2 * maze_h - 1;
+    return 0;
+}
+
+// Carves an L-shaped corridor: along row `ay` first, then along column `bx`
+static void carve_corridor(uint64_t *plane, int ax, int ay, int bx, int by) {
+    for (int x = ax < bx ? ax : bx; x <= (ax < bx ? bx : ax); x++) {
+        set_obstacle(plane, x, ay, false);
+    }
+    for (int y = ay < by ? ay : by; y <= (ay < by ? by : ay); y++) {
+        set_obstacle(plane, bx, y, false);
+    }
+}
+
+// One room per ROOMS_TILE_SIZE square tile (the leftover strips on the right
+// and bottom stay solid). Every room is joined to the room on its right, and
+// to the room below it either always (first column) or at random, so all
+// rooms are reachable. Start and goal are the centers of the first and last
+// rooms
+static int generate_rooms(uint64_t *plane, struct GenRng *rng) {
+    int const tiles_w = g_grid_width / ROOMS_TILE_SIZE;
+    int const tiles_h = g_grid_height / ROOMS_TILE_SIZE;
+    int *centers = malloc((size_t) tiles_w * tiles_h * 2 * sizeof(*centers));
+    if (!centers) {
+        fprintf(stderr, "Error: Failed to allocate room list\n");
+        return -1;
+    }
+
+    fill_obstacles(plane);
+    for (int ty = 0; ty < tiles_h; ty++) {
+        for (int tx = 0; tx < tiles_w; tx++) {
+            // Rooms keep at least one wall cell to the tile border
+            int const room_w = 3 + rng_below(rng, ROOMS_TILE_SIZE - 5);
+            int const room_h = 3 + rng_below(rng, ROOMS_TILE_SIZE - 5);
+            int const x0 = tx * ROOMS_TILE_SIZE + 1 + rng_below(rng, ROOMS_TILE_SIZE - 1 - room_w);
+            int const y0 = ty * ROOMS_TILE_SIZE + 1 + rng_below(rng, ROOMS_TILE_SIZE - 1 - room_h);
+            for (int y = y0; y < y0 + room_h; y++) {
+                for (int x = x0; x < x0 + room_w; x++) {
+                    set_obstacle(plane, x, y, false);
+                }
+            }
+            size_t const tile = (size_t) ty * tiles_w + tx;
+            centers[2 * tile] = x0 + room_w / 2;
+            centers[2 * tile + 1] = y0 + room_h / 2;
+        }
+    }
+
+    for (int ty = 0; ty < tiles_h; ty++) {
+        for (int tx = 0; tx < tiles_w; tx++) {
+            int const *a = &centers[2 * ((size_t) ty * tiles_w + tx)];
+            if (tx + 1 < tiles_w) {
+                int const *b = a + 2;
+                carve_corridor(plane, a[0], a[1], b[0], b[1]);
+            }
+            if (ty + 1 < tiles_h && (tx == 0 || rng_unif(rng) < 0.25)) {
+                int const *b = a + 2 * (size_t) tiles_w;
+                carve_corridor(plane, a[0], a[1], b[0], b[1]);
+            }
+        }
+    }
+
+    size_t const last = (size_t) tiles_w * tiles_h - 1;
+    g_start_x = centers[0];
+    g_start_y = centers[1];
+    g_goal_x = centers[2 * last];
+    g_goal_y = centers[2 * last + 1];
+    free(centers);
+    return 0;
+}
+
+int generate_grid(struct GridGenParams const *params) {
+    if (!is_valid_GridGenParams(params)) {
+        fprintf(stderr, "Error: Invalid grid generation parameters %dx%d, density %g "
+                "(mazes need at least 3x3 cells, rooms %dx%d)\n",
+                params->width, params->height, params->density, ROOMS_TILE_SIZE, ROOMS_TILE_SIZE);
+        return -1;
+    }
+
+    uint64_t *plane = grid_map_alloc(params->width, params->height);
+    if (!plane) {
+        return -1;
+    }
+
+    struct GenRng rng = {params->seed};
+    switch (params->kind) {
+        case GRID_KIND_open:
+            g_start_x = 0;
+            g_start_y = 0;
+            g_goal_x = g_grid_width - 1;
+            g_goal_y = g_grid_height - 1;
+            return 0;
+        case GRID_KIND_random:
+            generate_random(plane, params->density, &rng);
+            return 0;
+        case GRID_KIND_maze:
+            return generate_maze(plane, &rng);
+        case GRID_KIND_rooms:
+            return generate_rooms(plane, &rng);
+    }
+    return -1;
+}
@@ -0,0 +1,53 @@
+#ifndef SEARCH_GENERATOR_H
+#define SEARCH_GENERATOR_H
+
+/** @file
+ * Procedural grids, built in memory instead of read from a file.
+ *
+ * Every grid is fully determined by its parameters (the seed included), and
+ * uses its own random number generator, so the same parameters produce the
+ * same grid on any machine and with any number of ranks.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Kinds of generated grids */
+enum GRID_KIND {
+  GRID_KIND_open,   /**< No obstacles at all */
+  GRID_KIND_random, /**< Every cell is an obstacle with probability `density` */
+  GRID_KIND_maze,   /**< Perfect maze (recursive backtracker), corridors one cell wide */
+  GRID_KIND_rooms   /**< Rooms laid on a coarse grid and joined by corridors */
+};
+
+/** Parameters of a generated grid.
+ * Invariants:
+ * - 0 < width <= MAX_GRID_WIDTH and 0 < height <= MAX_GRID_HEIGHT
+ * - width, height >= 3 for mazes and >= ROOMS_TILE_SIZE for rooms
+ * - 0 <= density <= 1 (only used by `GRID_KIND_random`)
+ */
+struct GridGenParams {
+  enum GRID_KIND kind;
+  int width;
+  int height;
+  double density;
+  uint64_t seed;
+};
+
+/** Side of the square tiles that hold one room each (`GRID_KIND_rooms`) */
+#define ROOMS_TILE_SIZE 16
+
+bool is_valid_GridGenParams(struct GridGenParams const *params);
+
+void assert_valid_GridGenParams(struct GridGenParams const *params);
+
+/** Parses the name of a grid kind ("open", "random", "maze" or "rooms").
+ * Returns false if the name is unknown. */
+bool grid_kind_from_name(char const *name, enum GRID_KIND *kind);
+
+/** Builds the grid described by `params` into the global grid variables
+ * (same as loading a grid file, see grid_map.h). Returns 0 on success, and
+ * prints the reason and returns -1 otherwise. */
+int generate_grid(struct GridGenParams const *params);
+
+#endif /* SEARCH_GENERATOR_H */
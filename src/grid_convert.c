@@ -0,0 +1,27 @@
+/** @file
+ * Converts a text grid file into the binary grid format (see grid_map.h).
+ *
+ * Usage: grid-convert input.txt output.grid
+ */
+
+#include "grid_map.h"
+#include "state.h"
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s input.txt output.grid\n", argv[0]);
+        return 1;
+    }
+
+    if (grid_map_load_text(argv[1]) != 0) {
+        return 1;
+    }
+
+    int const res = grid_map_write_binary(argv[2]);
+    if (res == 0) {
+        printf("Wrote %dx%d grid to %s\n", g_grid_width, g_grid_height, argv[2]);
+    }
+    grid_map_free();
+    return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,417 @@
+#include "grid_map.h"
+#include "state.h"
+#include <fcntl.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ================================= Local variables ================================
+
+// Plane allocated by the text loader (NULL when the grid is mapped)
+static uint64_t *owned_plane = NULL;
+
+// Whole binary file, as mapped by the binary loader
+static void *mapped_file = NULL;
+static size_t mapped_size = 0;
+
+// Writable version of `g_free_cells_before`
+static uint64_t *free_cells_before = NULL;
+
+// Writable version of `g_corridor_plane`
+static uint64_t *corridor_plane = NULL;
+
+// Node-shared copy of the plane, as set up by `grid_map_share`
+static MPI_Win shared_window = MPI_WIN_NULL;
+
+// Largest piece of the plane sent in one broadcast (in words)
+#define BCAST_CHUNK_WORDS (1 << 26)
+
+bool is_valid_GridMapHeader(struct GridMapHeader const *header) {
+    return memcmp(header->magic, GRID_MAP_MAGIC, sizeof(header->magic)) == 0
+        && header->header_size % 8 == 0
+        && header->header_size >= sizeof(struct GridMapHeader)
+        && header->width > 0 && header->width <= MAX_GRID_WIDTH
+        && header->height > 0 && header->height <= MAX_GRID_HEIGHT
+        && header->start_x >= 0 && header->start_x < header->width
+        && header->start_y >= 0 && header->start_y < header->height
+        && header->goal_x >= 0 && header->goal_x < header->width
+        && header->goal_y >= 0 && header->goal_y < header->height
+        && header->plane_words == ((uint64_t) header->width * header->height + 63) / 64;
+}
+
+void assert_valid_GridMapHeader(struct GridMapHeader const *header) {
+#ifndef NDEBUG
+    assert(memcmp(header->magic, GRID_MAP_MAGIC, sizeof(header->magic)) == 0);
+    assert(header->header_size % 8 == 0);
+    assert(header->header_size >= sizeof(struct GridMapHeader));
+    assert(header->width > 0 && header->width <= MAX_GRID_WIDTH);
+    assert(header->height > 0 && header->height <= MAX_GRID_HEIGHT);
+    assert(header->start_x >= 0 && header->start_x < header->width);
+    assert(header->start_y >= 0 && header->start_y < header->height);
+    assert(header->goal_x >= 0 && header->goal_x < header->width);
+    assert(header->goal_y >= 0 && header->goal_y < header->height);
+    assert(header->plane_words == ((uint64_t) header->width * header->height + 63) / 64);
+#endif
+}
+
+size_t grid_plane_words(void) {
+    return (grid_num_cells() + 63) / 64;
+}
+
+static bool valid_dimensions(void) {
+    if (g_grid_width <= 0 || g_grid_height <= 0 ||
+        g_grid_width > MAX_GRID_WIDTH || g_grid_height > MAX_GRID_HEIGHT) {
+        fprintf(stderr, "Error: Invalid grid dimensions %dx%d (maximum is %dx%d)\n",
+                g_grid_width, g_grid_height, MAX_GRID_WIDTH, MAX_GRID_HEIGHT);
+        return false;
+    }
+    return true;
+}
+
+uint64_t *grid_map_alloc(int width, int height) {
+    g_grid_width = width;
+    g_grid_height = height;
+    if (!valid_dimensions()) {
+        return NULL;
+    }
+
+    owned_plane = calloc(grid_plane_words(), sizeof(*owned_plane));
+    if (!owned_plane) {
+        fprintf(stderr, "Error: Failed to allocate grid memory (%zu cells)\n", grid_num_cells());
+        return NULL;
+    }
+    g_obstacle_plane = owned_plane;
+    return owned_plane;
+}
+
+
+// ================================= Text format ===============================
+
+// Reads one cell row. Spaces are ignored and extra characters past the grid
+// width are dropped (as are unknown characters, after a warning)
+static void parse_grid_row(char const *line, int y) {
+    int x = 0;
+    for (char const *p = line; *p && x < g_grid_width; p++) {
+        switch (*p) {
+            case ' ': case '\t': case '\n': case '\r':
+                continue;
+            case '.':
+                break;
+            case '#': {
+                size_t const idx = grid_index(x, y);
+                owned_plane[idx / 64] |= UINT64_C(1) << (idx % 64);
+                break;
+            }
+            case 'S':
+                g_start_x = x;
+                g_start_y = y;
+                break;
+            case 'G':
+                g_goal_x = x;
+                g_goal_y = y;
+                break;
+            default:
+                fprintf(stderr, "Warning: Unknown character '%c' at (%d,%d), treating as free\n", *p, x, y);
+                continue;
+        }
+        x++;
+    }
+}
+
+// The file is read one line at a time with `getline`, which grows the line
+// buffer as needed, so rows can be arbitrarily long
+int grid_map_load_text(char const *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open grid file '%s'\n", filename);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+
+    // Skip comments and find dimensions
+    while (getline(&line, &line_capacity, fp) != -1) {
+        if (line[0] == '/' && line[1] == '/') continue;
+        if (sscanf(line, "%d %d", &g_grid_width, &g_grid_height) == 2) {
+            break;
+        }
+    }
+
+    if (!valid_dimensions()) {
+        free(line);
+        fclose(fp);
+        return -1;
+    }
+
+    if (!grid_map_alloc(g_grid_width, g_grid_height)) {
+        free(line);
+        fclose(fp);
+        return -1;
+    }
+
+    // Parse grid content
+    int y = 0;
+    while (y < g_grid_height && getline(&line, &line_capacity, fp) != -1) {
+        if (line[0] == '/' && line[1] == '/') continue;
+        parse_grid_row(line, y);
+        y++;
+    }
+
+    free(line);
+    fclose(fp);
+
+    // Validate start and goal positions
+    if (g_start_x < 0 || g_start_y < 0) {
+        fprintf(stderr, "Error: No start position 'S' found in grid\n");
+        return -1;
+    }
+    if (g_goal_x < 0 || g_goal_y < 0) {
+        fprintf(stderr, "Error: No goal position 'G' found in grid\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+// ================================= Binary format ===============================
+
+int grid_map_load_binary(char const *filename) {
+    int const fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open grid file '%s'\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct GridMapHeader)) {
+        fprintf(stderr, "Error: Grid file '%s' is too short to be a binary grid\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    void *const base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map grid file '%s'\n", filename);
+        return -1;
+    }
+
+    struct GridMapHeader const *header = base;
+    if (header->version != GRID_MAP_VERSION || !is_valid_GridMapHeader(header)
+        || header->header_size + header->plane_words * sizeof(uint64_t) > (size_t) st.st_size) {
+        fprintf(stderr, "Error: '%s' is not a valid binary grid file (version %d)\n",
+                filename, GRID_MAP_VERSION);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    mapped_file = base;
+    mapped_size = st.st_size;
+
+    g_grid_width = header->width;
+    g_grid_height = header->height;
+    g_start_x = header->start_x;
+    g_start_y = header->start_y;
+    g_goal_x = header->goal_x;
+    g_goal_y = header->goal_y;
+    g_obstacle_plane = (uint64_t const *) ((char const *) base + header->header_size);
+    return 0;
+}
+
+// Header describing the current grid
+static struct GridMapHeader current_header(void) {
+    struct GridMapHeader header = {
+        .version = GRID_MAP_VERSION,
+        .header_size = sizeof(struct GridMapHeader),
+        .width = g_grid_width,
+        .height = g_grid_height,
+        .start_x = g_start_x,
+        .start_y = g_start_y,
+        .goal_x = g_goal_x,
+        .goal_y = g_goal_y,
+        .plane_words = grid_plane_words(),
+    };
+    memcpy(header.magic, GRID_MAP_MAGIC, sizeof(header.magic));
+    assert_valid_GridMapHeader(&header);
+    return header;
+}
+
+int grid_map_write_binary(char const *filename) {
+    assert(g_obstacle_plane);
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot create grid file '%s'\n", filename);
+        return -1;
+    }
+
+    struct GridMapHeader const header = current_header();
+
+    bool const ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(g_obstacle_plane, sizeof(uint64_t), header.plane_words, fp) == header.plane_words;
+    if (fclose(fp) != 0 || !ok) {
+        fprintf(stderr, "Error: Failed to write grid file '%s'\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+
+// ================================= Common ===============================
+
+int grid_map_load(char const *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open grid file '%s'\n", filename);
+        return -1;
+    }
+    char magic[sizeof(GRID_MAP_MAGIC) - 1];
+    bool const is_binary = fread(magic, sizeof(magic), 1, fp) == 1
+        && memcmp(magic, GRID_MAP_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+
+    return is_binary ? grid_map_load_binary(filename) : grid_map_load_text(filename);
+}
+
+// Frees the plane loaded by this rank alone
+static void free_local_plane(void) {
+    if (owned_plane) { free(owned_plane); owned_plane = NULL; }
+    if (mapped_file) { munmap(mapped_file, mapped_size); mapped_file = NULL; }
+    g_obstacle_plane = NULL;
+}
+
+// Rank 0 broadcasts whether loading worked (the reason has already been
+// printed by rank 0), then the header and finally the plane. The plane only
+// travels to the lowest rank of every node, which writes it into a window
+// shared by all ranks on the node
+int grid_map_share(int load_status, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    int status = load_status;
+    struct GridMapHeader header = {0};
+    if (rank == 0 && status == 0) {
+        header = current_header();
+    }
+    MPI_Bcast(&status, 1, MPI_INT, 0, comm);
+    if (status != 0) {
+        return -1;
+    }
+    MPI_Bcast(&header, sizeof(header), MPI_BYTE, 0, comm);
+    assert_valid_GridMapHeader(&header);
+
+    g_grid_width = header.width;
+    g_grid_height = header.height;
+    g_start_x = header.start_x;
+    g_start_y = header.start_y;
+    g_goal_x = header.goal_x;
+    g_goal_y = header.goal_y;
+
+    // Ranks are ordered by `rank` within nodes, so rank 0 leads its node
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+    int node_rank;
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm leaders_comm;
+    MPI_Comm_split(comm, node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leaders_comm);
+
+    MPI_Aint const plane_size = node_rank == 0 ? header.plane_words * sizeof(uint64_t) : 0;
+    uint64_t *plane = NULL;
+    MPI_Win_allocate_shared(plane_size, sizeof(uint64_t), MPI_INFO_NULL, node_comm, &plane, &shared_window);
+    if (node_rank != 0) {
+        MPI_Aint size;
+        int disp_unit;
+        MPI_Win_shared_query(shared_window, 0, &size, &disp_unit, &plane);
+    }
+
+    MPI_Win_fence(0, shared_window);
+    if (node_rank == 0) {
+        if (rank == 0) {
+            memcpy(plane, g_obstacle_plane, plane_size);
+            free_local_plane();
+        }
+        for (uint64_t offset = 0; offset < header.plane_words; offset += BCAST_CHUNK_WORDS) {
+            uint64_t const remaining = header.plane_words - offset;
+            int const count = remaining < BCAST_CHUNK_WORDS ? (int) remaining : BCAST_CHUNK_WORDS;
+            MPI_Bcast(plane + offset, count, MPI_UINT64_T, 0, leaders_comm);
+        }
+        MPI_Comm_free(&leaders_comm);
+    }
+    MPI_Win_fence(0, shared_window);
+    MPI_Comm_free(&node_comm);
+
+    g_obstacle_plane = plane;
+    return 0;
+}
+
+// Free cells are the zero bits of the plane, leaving out the padding past
+// the last cell
+int grid_map_index_free_cells(void) {
+    size_t const num_cells = grid_num_cells();
+    size_t const num_words = grid_plane_words();
+    free_cells_before = malloc((num_words + 1) * sizeof(*free_cells_before));
+    if (!free_cells_before) {
+        fprintf(stderr, "Error: Failed to allocate the free cell index (%zu words)\n", num_words);
+        return -1;
+    }
+
+    size_t num_free = 0;
+    for (size_t w = 0; w < num_words; w++) {
+        free_cells_before[w] = num_free;
+        uint64_t free_bits = ~g_obstacle_plane[w];
+        if (w == num_words - 1 && num_cells % 64 != 0) {
+            free_bits &= (UINT64_C(1) << (num_cells % 64)) - 1;
+        }
+        num_free += __builtin_popcountll(free_bits);
+    }
+    free_cells_before[num_words] = num_free;
+
+    g_free_cells_before = free_cells_before;
+    g_num_free_cells = num_free;
+    return 0;
+}
+
+int grid_map_index_corridors(void) {
+    corridor_plane = calloc(grid_plane_words(), sizeof(*corridor_plane));
+    if (!corridor_plane) {
+        fprintf(stderr, "Error: Failed to allocate the corridor plane (%zu words)\n", grid_plane_words());
+        return -1;
+    }
+
+    int const dx[] = {0, 0, 1, -1};
+    int const dy[] = {-1, 1, 0, 0};
+    for (int y = 0; y < g_grid_height; y++) {
+        for (int x = 0; x < g_grid_width; x++) {
+            if (grid_is_obstacle(x, y)) continue;
+            int num_free = 0;
+            for (int i = 0; i < 4; i++) {
+                num_free += is_valid_position(x + dx[i], y + dy[i]) && !grid_is_obstacle(x + dx[i], y + dy[i]);
+            }
+            if (num_free == 2) {
+                size_t const idx = grid_index(x, y);
+                corridor_plane[idx / 64] |= UINT64_C(1) << (idx % 64);
+            }
+        }
+    }
+
+    g_corridor_plane = corridor_plane;
+    return 0;
+}
+
+void grid_map_free(void) {
+    if (shared_window != MPI_WIN_NULL) {
+        MPI_Win_free(&shared_window);
+        g_obstacle_plane = NULL;
+    }
+    free_local_plane();
+    if (free_cells_before) { free(free_cells_before); free_cells_before = NULL; }
+    g_free_cells_before = NULL;
+    g_num_free_cells = 0;
+    free(corridor_plane);
+    corridor_plane = NULL;
+    g_corridor_plane = NULL;
+}
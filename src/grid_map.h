@@ -0,0 +1,93 @@
+#ifndef SEARCH_GRID_MAP_H
+#define SEARCH_GRID_MAP_H
+
+/** @file
+ * Loading of the initial grid (`g_obstacle_plane`, dimensions, start and
+ * goal) from text and binary grid files.
+ *
+ * The binary format is the in-memory layout of the grid preceded by a
+ * `struct GridMapHeader`: the obstacle plane starts at `header_size` bytes
+ * into the file and holds `plane_words` 64-bit words (see `g_obstacle_plane`).
+ * Loading a binary file maps it into memory, so no parsing happens. The
+ * whole plane is still read: rank 0 copies it into the node-shared window of
+ * `grid_map_share`, and every rank scans it to index the free cells. All
+ * fields are in host byte order.
+ */
+
+#include <mpi.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GRID_MAP_MAGIC "SRCHGRID"
+#define GRID_MAP_VERSION 1
+
+/** Header of a binary grid file.
+ * Invariants:
+ * - `magic` is `GRID_MAP_MAGIC` (without the terminating zero)
+ * - `header_size` is a multiple of 8 and at least `sizeof(struct GridMapHeader)`
+ * - 0 < width <= MAX_GRID_WIDTH, 0 < height <= MAX_GRID_HEIGHT
+ * - start and goal lie inside the grid
+ * - plane_words == ceil(width * height / 64)
+ */
+struct GridMapHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;  /**< Offset of the obstacle plane in the file */
+  int32_t width;
+  int32_t height;
+  int32_t start_x, start_y;
+  int32_t goal_x, goal_y;
+  uint64_t plane_words;
+};
+
+bool is_valid_GridMapHeader(struct GridMapHeader const *header);
+
+void assert_valid_GridMapHeader(struct GridMapHeader const *header);
+
+/** Number of 64-bit words in the obstacle plane of the current grid. */
+size_t grid_plane_words(void);
+
+/** Loads a grid file in either format (binary files are recognized by their
+ * magic). Returns 0 on success, and prints the reason and returns -1 if the
+ * file cannot be loaded. */
+int grid_map_load(char const *filename);
+
+/** Collective over `comm`. Shares the grid loaded by rank 0 (whose loader
+ * returned `load_status`, the value of the argument on other ranks is
+ * ignored) with the other ranks. All ranks on a node read the same copy of
+ * the obstacle plane. Returns -1 on every rank if rank 0 failed to load the
+ * grid. */
+int grid_map_share(int load_status, MPI_Comm comm);
+
+/** Sets the grid dimensions and allocates an empty (obstacle free) plane for
+ * them, which becomes `g_obstacle_plane`. Returns the writable plane, or NULL
+ * (after printing why) if the dimensions are invalid or memory ran out. */
+uint64_t *grid_map_alloc(int width, int height);
+
+/** Loads a text grid file (see README for the format). Fails if the grid has
+ * no start or no goal. */
+int grid_map_load_text(char const *filename);
+
+/** Maps a binary grid file into memory. */
+int grid_map_load_binary(char const *filename);
+
+/** Writes the current grid as a binary grid file. Returns 0 on success. */
+int grid_map_write_binary(char const *filename);
+
+/** Counts the free cells of the current grid (`g_free_cells_before` and
+ * `g_num_free_cells`), from which LPs are numbered. Returns 0 on success, and
+ * -1 (after printing why) if memory ran out. */
+int grid_map_index_free_cells(void);
+
+/** Finds the corridor cells of the current grid (`g_corridor_plane`): free
+ * cells with exactly two free neighbours. Returns 0 on success, and -1 (after
+ * printing why) if memory ran out. */
+int grid_map_index_corridors(void);
+
+/** Releases the obstacle plane (unmapping it if it came from a binary file)
+ * and the free cell index.
+ * Collective if the grid was shared with `grid_map_share`. */
+void grid_map_free(void);
+
+#endif /* SEARCH_GRID_MAP_H */
@@ -0,0 +1,217 @@
+#include "hook_stats.h"
+#include "utils.h"
+#include <ross.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ================================= Local variables ================================
+
+/** Totals of this rank, as gathered on rank 0 */
+struct HookSummary {
+    double phase_seconds[NUM_HOOK_PHASES];
+    double hook_seconds;
+    uint64_t num_hooks;
+    uint64_t num_transfers_out;   /**< Clones and pooled branches sent */
+    uint64_t num_transfers_in;    /**< Branches received */
+    uint64_t num_stored;          /**< Branches stored in the pool */
+    uint64_t num_spilled;         /**< Branches written to disk */
+    uint64_t states_bytes_out, events_bytes_out;
+    uint64_t states_bytes_in, events_bytes_in;
+    uint64_t num_events_out, num_events_in;
+};
+
+static struct HookSummary summary;
+
+/** A transfer, as written to the trace */
+struct TransferRecord {
+    enum BRANCH_TRANSFER kind;
+    int peer;
+    int num_dirty;
+    int num_events;
+    uint64_t states_bytes;
+    uint64_t events_bytes;
+    double pack_seconds;      /**< Part of `seconds` packing the LP states */
+    double snapshot_seconds;  /**< Part of `seconds` snapshotting the events */
+    double seconds;
+    double gvt;
+};
+
+static bool tracing = false;
+static struct TransferRecord *records = NULL;
+static size_t num_records = 0;
+static size_t records_capacity = 0;
+
+static char const *const phase_names[NUM_HOOK_PHASES] = {
+    "rollback", "network", "allgather", "recycle", "send", "pool", "receive", "advance", "claim",
+    "pack_states", "snapshot_events"};
+static char const *const transfer_names[] = {"clone_sent", "pooled_sent", "stored", "received", "unpooled",
+                                                     "spilled", "loaded"};
+
+// ================================= Collecting ================================
+
+void hook_stats_init(bool trace) {
+    summary = (struct HookSummary) {0};
+    tracing = trace;
+}
+
+double hook_stats_begin(void) {
+    return MPI_Wtime();
+}
+
+double hook_stats_end(enum HOOK_PHASE phase, double began) {
+    double const seconds = MPI_Wtime() - began;
+    summary.phase_seconds[phase] += seconds;
+    return seconds;
+}
+
+void hook_stats_hook_done(double began) {
+    summary.hook_seconds += MPI_Wtime() - began;
+    summary.num_hooks++;
+}
+
+void hook_stats_transfer(enum BRANCH_TRANSFER kind, int peer, int num_dirty, size_t states_bytes,
+                         int num_events, size_t events_bytes, double pack_seconds, double snapshot_seconds,
+                         double seconds, double gvt) {
+    switch (kind) {
+        case BRANCH_TRANSFER_clone_sent:
+        case BRANCH_TRANSFER_pooled_sent:
+            summary.num_transfers_out++;
+            summary.states_bytes_out += states_bytes;
+            summary.events_bytes_out += events_bytes;
+            summary.num_events_out += num_events;
+        break;
+        case BRANCH_TRANSFER_received:
+            summary.num_transfers_in++;
+            summary.states_bytes_in += states_bytes;
+            summary.events_bytes_in += events_bytes;
+            summary.num_events_in += num_events;
+        break;
+        case BRANCH_TRANSFER_stored:
+            summary.num_stored++;
+        break;
+        case BRANCH_TRANSFER_spilled:
+            summary.num_spilled++;
+        break;
+        case BRANCH_TRANSFER_unpooled:
+        case BRANCH_TRANSFER_loaded:
+        break;
+    }
+
+    if (!tracing) {
+        return;
+    }
+    if (num_records == records_capacity) {
+        size_t const new_capacity = records_capacity ? 2 * records_capacity : 256;
+        struct TransferRecord *grown = realloc(records, new_capacity * sizeof(*records));
+        if (!grown) {
+            tw_error(TW_LOC, "Failed to allocate %zu transfer records", new_capacity);
+        }
+        records = grown;
+        records_capacity = new_capacity;
+    }
+    records[num_records++] = (struct TransferRecord) {
+        .kind = kind,
+        .peer = peer,
+        .num_dirty = num_dirty,
+        .num_events = num_events,
+        .states_bytes = states_bytes,
+        .events_bytes = events_bytes,
+        .pack_seconds = pack_seconds,
+        .snapshot_seconds = snapshot_seconds,
+        .seconds = seconds,
+        .gvt = gvt,
+    };
+}
+
+// ================================= Output ================================
+
+static void write_summary(MPI_Comm comm) {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    struct HookSummary *all = NULL;
+    if (rank == 0) {
+        all = malloc(size * sizeof(*all));
+        if (!all) {
+            tw_error(TW_LOC, "Failed to allocate the hook statistics of %d ranks", size);
+        }
+    }
+    MPI_Gather(&summary, sizeof(summary), MPI_BYTE, all, sizeof(summary), MPI_BYTE, 0, comm);
+    if (rank != 0) {
+        return;
+    }
+
+    FILE *fp = fopen("search-hook-stats.txt", "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot create hook statistics file\n");
+    } else {
+        fprintf(fp, "# pe hooks hook_s");
+        for (int phase = 0; phase < NUM_HOOK_PHASES; phase++) {
+            fprintf(fp, " %s_s", phase_names[phase]);
+        }
+        fprintf(fp, " sent stored spilled received states_bytes_out events_out events_bytes_out"
+                    " states_bytes_in events_in events_bytes_in\n");
+        for (int r = 0; r < size; r++) {
+            struct HookSummary const *s = &all[r];
+            fprintf(fp, "%d %llu %.6f", r, (unsigned long long) s->num_hooks, s->hook_seconds);
+            for (int phase = 0; phase < NUM_HOOK_PHASES; phase++) {
+                fprintf(fp, " %.6f", s->phase_seconds[phase]);
+            }
+            fprintf(fp, " %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+                    (unsigned long long) s->num_transfers_out, (unsigned long long) s->num_stored,
+                    (unsigned long long) s->num_spilled,
+                    (unsigned long long) s->num_transfers_in,
+                    (unsigned long long) s->states_bytes_out, (unsigned long long) s->num_events_out,
+                    (unsigned long long) s->events_bytes_out,
+                    (unsigned long long) s->states_bytes_in, (unsigned long long) s->num_events_in,
+                    (unsigned long long) s->events_bytes_in);
+        }
+        fclose(fp);
+        printf("Hook statistics written to search-hook-stats.txt\n");
+    }
+    free(all);
+}
+
+// Longest line a record can take
+#define MAX_LINE_SIZE 256
+
+static void write_trace(MPI_Comm comm) {
+    char *text = malloc(num_records * MAX_LINE_SIZE + 1);
+    if (!text) {
+        tw_error(TW_LOC, "Failed to allocate the text of %zu transfer records", num_records);
+    }
+    size_t size = 0;
+    for (size_t i = 0; i < num_records; i++) {
+        struct TransferRecord const *record = &records[i];
+        size += sprintf(text + size, "%d,%s,%d,%d,%llu,%d,%llu,%.9f,%.9f,%.9f,%.9g\n",
+                        (int) g_tw_mynode, transfer_names[record->kind], record->peer,
+                        record->num_dirty, (unsigned long long) record->states_bytes,
+                        record->num_events, (unsigned long long) record->events_bytes,
+                        record->pack_seconds, record->snapshot_seconds, record->seconds, record->gvt);
+    }
+
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (write_rank_ordered_file(comm, "search-clone-trace.csv",
+            "pe,transfer,peer,num_dirty,states_bytes,num_events,events_bytes,pack_states_s,snapshot_events_s,seconds,gvt\n", text, size, NULL) == 0
+        && rank == 0) {
+        printf("Clone trace written to search-clone-trace.csv\n");
+    }
+    free(text);
+}
+
+void hook_stats_write(MPI_Comm comm) {
+    write_summary(comm);
+    if (tracing) {
+        write_trace(comm);
+    }
+}
+
+void hook_stats_free(void) {
+    free(records);
+    records = NULL;
+    num_records = 0;
+    records_capacity = 0;
+}
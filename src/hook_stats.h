@@ -0,0 +1,72 @@
+#ifndef SEARCH_HOOK_STATS_H
+#define SEARCH_HOOK_STATS_H
+
+/** @file
+ * Where the time of the director's GVT hook goes. Every phase of the hook is
+ * timed (with `MPI_Wtime`), and every branch transfer (clone, pooled branch,
+ * pool store, spill to disk) counts the LP states and events it moves. All ranks report a
+ * summary at the end of the run, and optionally a trace with one line per
+ * transfer.
+ */
+
+#include <mpi.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Phases of the GVT hook */
+enum HOOK_PHASE {
+  HOOK_PHASE_rollback = 0,  /**< `tw_scheduler_rollback_and_cancel_events_pe` */
+  HOOK_PHASE_network,       /**< Draining the network of the group and completing the previous transfers */
+  HOOK_PHASE_allgather,     /**< Sharing the status of every PE */
+  HOOK_PHASE_recycle,       /**< Collecting the results of a finished branch */
+  HOOK_PHASE_send,          /**< Posting the send of a packed branch */
+  HOOK_PHASE_pool,          /**< Storing a packed branch in the pool, or moving branches between the pool and the disk */
+  HOOK_PHASE_receive,       /**< Waiting for a branch and installing it (or taking it from the pool) */
+  HOOK_PHASE_advance,       /**< `advance_to_direction` */
+  HOOK_PHASE_claim,         /**< Claiming empty groups and receiving assignments with one-sided allocation (instead of the allgather) */
+  HOOK_PHASE_pack_states,   /**< Packing the dirty LP states of a branch (to send, pool or spill it) */
+  HOOK_PHASE_snapshot_events /**< Snapshotting the pending events of a branch (to send, pool or spill it) */
+};
+
+#define NUM_HOOK_PHASES 11
+
+/** Ways a branch moves, as recorded per transfer */
+enum BRANCH_TRANSFER {
+  BRANCH_TRANSFER_clone_sent = 0,  /**< Second branch of a decision sent to an empty group */
+  BRANCH_TRANSFER_pooled_sent,     /**< Pooled branch sent to an empty group */
+  BRANCH_TRANSFER_stored,          /**< Second branch of a decision stored in the pool */
+  BRANCH_TRANSFER_received,        /**< Branch received from another group */
+  BRANCH_TRANSFER_unpooled,        /**< Branch taken from the pool of this group */
+  BRANCH_TRANSFER_spilled,         /**< Second branch of a decision written to disk, as the pool was full */
+  BRANCH_TRANSFER_loaded           /**< Branch read from disk into the pool */
+};
+
+/** Starts collecting. With `trace`, every transfer is also kept to be written
+ * by `hook_stats_write`. */
+void hook_stats_init(bool trace);
+
+/** Current time, to be given to `hook_stats_end` when the phase ends. */
+double hook_stats_begin(void);
+
+/** Adds the time since `began` to `phase`, and returns it. */
+double hook_stats_end(enum HOOK_PHASE phase, double began);
+
+/** Counts a call to the hook that started at `began`. */
+void hook_stats_hook_done(double began);
+
+/** Records a transfer of `num_dirty` LP states and `num_events` events with
+ * `peer` (-1 for the pool), which took `seconds` at GVT `gvt`, of which
+ * `pack_seconds` packing the states and `snapshot_seconds` snapshotting the
+ * events (both 0 for transfers of a branch packed already). */
+void hook_stats_transfer(enum BRANCH_TRANSFER kind, int peer, int num_dirty, size_t states_bytes,
+                         int num_events, size_t events_bytes, double pack_seconds, double snapshot_seconds,
+                         double seconds, double gvt);
+
+/** Writes the summary of every rank of `comm` to `search-hook-stats.txt` and,
+ * when tracing, all transfers to `search-clone-trace.csv`. Collective. */
+void hook_stats_write(MPI_Comm comm);
+
+/** Frees the trace. */
+void hook_stats_free(void);
+
+#endif /* SEARCH_HOOK_STATS_H */
@@ -1,84 +1,242 @@
-#include <ross.h>
+#include "mapping.h"
+#include "state.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ================================= Global variables ================================
+
+struct GridTiling g_tiling = {.group_size = 1, .tiles_x = 1, .tiles_y = 1};
+size_t const *g_lp_cell = NULL;
+
+// Writable version of `g_lp_cell`
+static size_t *lp_cell = NULL;
+
+bool is_valid_GridTiling(struct GridTiling const *tiling) {
+    return tiling->group_size >= 1
+        && tiling->tiles_x * tiling->tiles_y == tiling->group_size
+        && tiling->tiles_x >= 1 && tiling->tiles_x <= g_grid_width
+        && tiling->tiles_y >= 1 && tiling->tiles_y <= g_grid_height
+        && tiling->lp_base && tiling->row_offset && tiling->row_prefix
+        && tiling->lp_base[0] == 0
+        && tiling->lp_base[tiling->group_size] == g_num_free_cells;
+}
 
-tw_peid search_lp_map(tw_lpid gid) { return (tw_peid)gid / g_tw_nlp; }
+void assert_valid_GridTiling(struct GridTiling const *tiling) {
+#ifndef NDEBUG
+    assert(tiling->group_size >= 1);
+    assert(tiling->tiles_x * tiling->tiles_y == tiling->group_size);
+    assert(tiling->tiles_x >= 1 && tiling->tiles_x <= g_grid_width);
+    assert(tiling->tiles_y >= 1 && tiling->tiles_y <= g_grid_height);
+    assert(tiling->lp_base && tiling->row_offset && tiling->row_prefix);
+    assert(tiling->lp_base[0] == 0);
+    assert(tiling->lp_base[tiling->group_size] == g_num_free_cells);
+#endif
+}
 
-/*
-// Multiple LP Types mapping function
-//    Given an LP's GID
-//    Return the index in the LP type array (defined in model_main.c)
-tw_lpid model_typemap (tw_lpid gid) {
-  // since this model has one type
-  // always return index of 1st LP type
-  return 0;
+// ================================= Tiling ================================
+
+// The divisor of `group_size` that gives the squarest tiles
+static int pick_tiles_x(int group_size) {
+    double const target = sqrt((double) group_size * g_grid_width / g_grid_height);
+    int best = 1;
+    for (int d = 1; d <= group_size; d++) {
+        if (group_size % d == 0 && fabs(log(d / target)) < fabs(log(best / target))) {
+            best = d;
+        }
+    }
+    return best;
 }
-*/
 
+// Free cells of row `y` between columns x0 (included) and x1 (excluded)
+static uint64_t free_cells_in_row(int y, int x0, int x1) {
+    return grid_free_cells_before(grid_index(0, y) + x1) - grid_free_cells_before(grid_index(x0, y));
+}
 
-/*
-// Custom mapping functions are used so
-// - no LPs are unused
-// - event activity is balanced
+int search_mapping_init(int group_size) {
+    int num_ranks;
+    MPI_Comm_size(MPI_COMM_ROSS, &num_ranks);
+    if (group_size < 1 || num_ranks % group_size != 0) {
+        if (g_tw_mynode == 0) {
+            fprintf(stderr, "Error: The number of ranks (%d) must be a multiple of the group size (%d)\n",
+                    num_ranks, group_size);
+        }
+        return -1;
+    }
 
-extern unsigned int nkp_per_pe;
-// #define VERIFY_MAPPING 1 // useful for debugging
+    g_tiling.group_size = group_size;
+    g_tiling.tiles_x = pick_tiles_x(group_size);
+    g_tiling.tiles_y = group_size / g_tiling.tiles_x;
+    if (g_tiling.tiles_x > g_grid_width || g_tiling.tiles_y > g_grid_height) {
+        if (g_tw_mynode == 0) {
+            fprintf(stderr, "Error: A %dx%d grid cannot be split in %dx%d tiles\n",
+                    g_grid_width, g_grid_height, g_tiling.tiles_x, g_tiling.tiles_y);
+        }
+        return -1;
+    }
 
-// This function maps LPs to KPs on PEs and is called at the start
-// This example is the same as Linear Mapping
-void model_custom_mapping(void){
-  tw_pe *pe;
-  int nlp_per_kp;
-  int lp_id, kp_id;
-  int i, j;
+    g_tiling.lp_base = malloc((group_size + 1) * sizeof(*g_tiling.lp_base));
+    g_tiling.row_offset = malloc(group_size * sizeof(*g_tiling.row_offset));
+    g_tiling.row_prefix = malloc((size_t) g_tiling.tiles_x * (g_grid_height + g_tiling.tiles_y) * sizeof(*g_tiling.row_prefix));
+    if (!g_tiling.lp_base || !g_tiling.row_offset || !g_tiling.row_prefix) {
+        fprintf(stderr, "Error: Failed to allocate the grid tiling\n");
+        return -1;
+    }
 
-  // nlp should be divisible by nkp (no wasted LPs)
-  nlp_per_kp = ceil((double) g_tw_nlp / (double) g_tw_nkp);
-  if (!nlp_per_kp) tw_error(TW_LOC, "Not enough KPs defined: %d", g_tw_nkp);
+    // Row prefixes keep one extra entry per tile (its total), which is where
+    // the next tile starts counting from
+    size_t offset = 0;
+    g_tiling.lp_base[0] = 0;
+    for (int tile = 0; tile < group_size; tile++) {
+        int const tx = tile % g_tiling.tiles_x;
+        int const ty = tile / g_tiling.tiles_x;
+        g_tiling.row_offset[tile] = offset;
+
+        uint64_t in_tile = 0;
+        for (int y = tile_y0(ty); y < tile_y0(ty + 1); y++) {
+            g_tiling.row_prefix[offset++] = in_tile;
+            in_tile += free_cells_in_row(y, tile_x0(tx), tile_x0(tx + 1));
+        }
+        g_tiling.row_prefix[offset++] = in_tile;
+        g_tiling.lp_base[tile + 1] = g_tiling.lp_base[tile] + in_tile;
+
+        // ROSS cannot run a PE without LPs
+        if (in_tile == 0) {
+            if (g_tw_mynode == 0) {
+                fprintf(stderr, "Error: Tile %d of the grid has no free cells, use a smaller group size\n", tile);
+            }
+            return -1;
+        }
+    }
+    assert_valid_GridTiling(&g_tiling);
 
-  // gid of first LP on this PE (aka node)
-  g_tw_lp_offset = g_tw_mynode * g_tw_nlp;
+    int const member = search_my_member();
+    g_tiling.group_lp_offset = (tw_lpid) search_my_group() * g_num_free_cells;
 
-#if VERIFY_MAPPING
-  prinf("NODE %d: nlp %lld, offset %lld\n", g_tw_mynode, g_tw_nlp,
-g_tw_lp_offset); #endif
+    // Cells of the local LPs, in LP order
+    tw_lpid const num_local = search_mapping_num_local_lps();
+    lp_cell = malloc(num_local * sizeof(*lp_cell));
+    if (!lp_cell) {
+        fprintf(stderr, "Error: Failed to allocate the cells of %llu LPs\n", (unsigned long long) num_local);
+        return -1;
+    }
+    int const tx = member % g_tiling.tiles_x;
+    int const ty = member / g_tiling.tiles_x;
+    tw_lpid lp = 0;
+    for (int y = tile_y0(ty); y < tile_y0(ty + 1); y++) {
+        for (int x = tile_x0(tx); x < tile_x0(tx + 1); x++) {
+            if (!grid_is_obstacle(x, y)) {
+                lp_cell[lp++] = grid_index(x, y);
+            }
+        }
+    }
+    assert(lp == num_local);
+    g_lp_cell = lp_cell;
 
-  // Loop through each PE (node)
-  for (kp_id = 0, lp_id = 0, pe = NULL; (pe = tw_pe_next(pe)); ) {
+    if (g_tw_mynode == 0 && group_size > 1) {
+        printf("Clone groups of %d ranks, grid split in %dx%d tiles\n", group_size, g_tiling.tiles_x, g_tiling.tiles_y);
+    }
+    return search_lp_pages_init(num_local);
+}
 
-    // Define each KP on the PE
-    for (i = 0; i < nkp_per_pe; i++, kp_id++) {
+void search_mapping_finalize(void) {
+    free(g_tiling.lp_base);
+    free(g_tiling.row_offset);
+    free(g_tiling.row_prefix);
+    g_tiling.lp_base = NULL;
+    g_tiling.row_offset = NULL;
+    g_tiling.row_prefix = NULL;
+    free(lp_cell);
+    lp_cell = NULL;
+    g_lp_cell = NULL;
+    search_lp_pages_free();
+}
+
+int search_my_group(void) {
+    return g_tw_mynode / g_tiling.group_size;
+}
 
-      tw_kp_onpe(kpid, pe);
+int search_my_member(void) {
+    return g_tw_mynode % g_tiling.group_size;
+}
 
-      // Define each LP on the KP
-      for (j = 0; j < nlp_per_kp && lp_id < g_tw_nlp; j++, lp_id++) {
+tw_lpid search_mapping_num_local_lps(void) {
+    int const member = search_my_member();
+    return g_tiling.lp_base[member + 1] - g_tiling.lp_base[member];
+}
 
-        tw_lp_onpe(lp_id, pe, g_tw_lp_offset + lp_id);
-        tw_lp_onkp(g_tw_lp[lp_id], g_tw_kp[kp_id]);
+bool search_cell_is_local(int x, int y) {
+    return tile_of_cell(x, y) == search_my_member();
+}
 
-#if VERIFY_MAPPING
-        if (0 == j % 20) { // print detailed output for only some LPs
-          printf("PE %d\tKP %d\tLP %d\n", pe->id, kp_id, (int) lp_id +
-g_tw_lp_offset);
+// ================================= ROSS mapping ================================
+
+// The group comes from the block of LPs the gid falls in, and the member from
+// the tile within the group (a binary search over `lp_base`)
+tw_peid search_lp_map(tw_lpid gid) {
+    tw_lpid const group = gid / g_num_free_cells;
+    tw_lpid const lp = gid % g_num_free_cells;
+
+    int lo = 0, hi = g_tiling.group_size - 1;
+    while (lo < hi) {
+        int const mid = (lo + hi + 1) / 2;
+        if (g_tiling.lp_base[mid] <= lp) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
-#endif
-      }
     }
-  }
-
-  // Error checks for the mapping
-  if (!g_tw_lp[g_tw_nlp - 1]) {
-    tw_error(TW_LOC, "Not all LPs defined! (g_tw_nlp=%d)", g_tw_nlp);
-  }
+    return (tw_peid) group * g_tiling.group_size + lo;
+}
 
-  if (g_tw_lp[g_tw_nlp - 1]->gid != g_tw_lp_offset + g_tw_nlp - 1) {
-    tw_error(TW_LOC, "LPs not sequentially enumerated");
-  }
+/*
+// Multiple LP Types mapping function
+//    Given an LP's GID
+//    Return the index in the LP type array (defined in model_main.c)
+tw_lpid model_typemap (tw_lpid gid) {
+  // since this model has one type
+  // always return index of 1st LP type
+  return 0;
 }
+*/
+
+// Same as ROSS's linear mapping, except that ranks hold different numbers of
+// LPs: the LPs of a rank are the free cells of its tile, starting at its
+// group's offset plus the LPs of the tiles before it
+void search_custom_mapping(void) {
+    tw_pe *pe;
+    tw_lpid nlp_per_kp;
+    tw_lpid lp_id;
+    unsigned int kp_id, i, j;
+
+    nlp_per_kp = (g_tw_nlp + g_tw_nkp - 1) / g_tw_nkp;
+    if (!nlp_per_kp) {
+        tw_error(TW_LOC, "Not enough KPs defined: %d", g_tw_nkp);
+    }
+
+    // gid of first LP on this PE (aka node)
+    g_tw_lp_offset = g_tiling.group_lp_offset + g_tiling.lp_base[search_my_member()];
+
+    for (kp_id = 0, lp_id = 0, pe = NULL; (pe = tw_pe_next(pe)); ) {
+        for (i = 0; i < g_tw_nkp; i++, kp_id++) {
+            tw_kp_onpe(kp_id, pe);
 
+            for (j = 0; j < nlp_per_kp && lp_id < g_tw_nlp; j++, lp_id++) {
+                tw_lp_onpe(lp_id, pe, g_tw_lp_offset + lp_id);
+                tw_lp_onkp(g_tw_lp[lp_id], g_tw_kp[kp_id]);
+            }
+        }
+    }
 
-// Given a gid, return the local LP (global id => local id mapping)
-tw_lp * model_mapping_to_lp(tw_lpid){
-  int local_id = lp_id - g_tw_offset;
-  return g_tw_lp[id];
+    // Error checks for the mapping
+    if (!g_tw_lp[g_tw_nlp - 1]) {
+        tw_error(TW_LOC, "Not all LPs defined! (g_tw_nlp=%llu)", (unsigned long long) g_tw_nlp);
+    }
+    if (g_tw_lp[g_tw_nlp - 1]->gid != g_tw_lp_offset + g_tw_nlp - 1) {
+        tw_error(TW_LOC, "LPs not sequentially enumerated");
+    }
+}
+
+tw_lp *search_mapping_to_lp(tw_lpid gid) {
+    return g_tw_lp[gid - g_tw_lp_offset];
 }
-*/
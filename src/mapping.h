@@ -6,23 +6,54 @@
  * This file includes:
  * - the required LP GID -> PE mapping function
  * - Commented out example of LPType map (when there multiple LP types)
- * - Commented out example of one set of custom mapping functions:
+ * - the custom mapping functions used by clone groups:
  *   - setup function to place LPs and KPs on PEs
  *   - local map function to find LP in local PE's array
+ *
+ * Ranks are split in clone groups of `g_tiling.group_size` consecutive ranks,
+ * and each group simulates one branch. Every group holds one LP per free cell
+ * of the grid, spread over its members by tiles (see `struct GridTiling`).
+ * With groups of one rank (the default), every rank holds the whole grid and
+ * the mapping is ROSS's linear mapping.
  */
 
-
 #include <ross.h>
+#include <stdbool.h>
+
+struct GridTiling;
+
+bool is_valid_GridTiling(struct GridTiling const *tiling);
+
+void assert_valid_GridTiling(struct GridTiling const *tiling);
+
+/** Splits the grid among the members of every clone group, and sets up the
+ * local LPs of this rank (`g_lp_cell` and the dirty LP pages). Needs the grid
+ * and its free cell index. Returns 0 on success, and -1 (after printing why)
+ * on every rank if the grid cannot be split in `group_size` tiles. */
+int search_mapping_init(int group_size);
+
+void search_mapping_finalize(void);
+
+/** Number of LPs on this rank (the free cells of its tile) */
+tw_lpid search_mapping_num_local_lps(void);
+
+/** Clone group of this rank, and its position in the group */
+int search_my_group(void);
+
+int search_my_member(void);
+
+/** Whether a cell (its LP) lives on this rank */
+bool search_cell_is_local(int x, int y);
 
 /** Mapping of LPs to SEs.
  * Given an LP's GID (global ID) return the PE (aka node, MPI Rank)
  */
 tw_peid search_lp_map(tw_lpid gid);
 
-/*
-void model_cutom_mapping(void);
-tw_lp * model_mapping_to_lp(tw_lpid lpid);
-tw_peid model_map(tw_lpid gid);
-*/
+/** Places the local LPs and KPs on the PE (`g_tw_custom_initial_mapping`) */
+void search_custom_mapping(void);
+
+/** Local LP of a gid (`g_tw_custom_lp_global_to_local_map`) */
+tw_lp * search_mapping_to_lp(tw_lpid gid);
 
 #endif /* end of include guard */
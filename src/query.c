@@ -0,0 +1,205 @@
+#include "query.h"
+#include "state.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ================================= Global variables ================================
+
+int g_num_queries = 0;
+int g_current_query = 0;
+
+static struct SearchQuery *queries = NULL;
+
+// Per query, number of branches finished on this PE and lowest PE that
+// reached the goal (INT_MAX if none)
+static int *branches_run = NULL;
+static int *found_by = NULL;
+
+bool is_valid_SearchQuery(struct SearchQuery const *query) {
+    return is_valid_position(query->start_x, query->start_y)
+        && is_valid_position(query->goal_x, query->goal_y)
+        && !grid_is_obstacle(query->start_x, query->start_y)
+        && !grid_is_obstacle(query->goal_x, query->goal_y);
+}
+
+void assert_valid_SearchQuery(struct SearchQuery const *query) {
+#ifndef NDEBUG
+    assert(is_valid_position(query->start_x, query->start_y));
+    assert(is_valid_position(query->goal_x, query->goal_y));
+    assert(!grid_is_obstacle(query->start_x, query->start_y));
+    assert(!grid_is_obstacle(query->goal_x, query->goal_y));
+#endif
+}
+
+// ================================= Loading ================================
+
+// Appends a query to `queries`, doubling its capacity when full
+static int push_query(struct SearchQuery const *query, int *capacity) {
+    if (g_num_queries == *capacity) {
+        int const new_capacity = *capacity ? 2 * *capacity : 64;
+        struct SearchQuery *grown = realloc(queries, new_capacity * sizeof(*queries));
+        if (!grown) {
+            fprintf(stderr, "Error: Failed to allocate %d queries\n", new_capacity);
+            return -1;
+        }
+        queries = grown;
+        *capacity = new_capacity;
+    }
+    queries[g_num_queries++] = *query;
+    return 0;
+}
+
+static int parse_query_file(char const *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open query file '%s'\n", filename);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int capacity = 0;
+    int line_number = 0;
+    int status = 0;
+    while (status == 0 && getline(&line, &line_capacity, fp) != -1) {
+        line_number++;
+        if (line[0] == '/' && line[1] == '/') continue;
+        if (line[strspn(line, " \t\r\n")] == '\0') continue;
+
+        struct SearchQuery query;
+        if (sscanf(line, "%d %d %d %d", &query.start_x, &query.start_y, &query.goal_x, &query.goal_y) != 4) {
+            fprintf(stderr, "Error: %s:%d: expected 'start_x start_y goal_x goal_y'\n", filename, line_number);
+            status = -1;
+        } else if (!is_valid_SearchQuery(&query)) {
+            fprintf(stderr, "Error: %s:%d: start (%d,%d) and goal (%d,%d) must be free cells of the grid\n",
+                    filename, line_number, query.start_x, query.start_y, query.goal_x, query.goal_y);
+            status = -1;
+        } else {
+            status = push_query(&query, &capacity);
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (status == 0 && g_num_queries == 0) {
+        fprintf(stderr, "Error: Query file '%s' has no queries\n", filename);
+        status = -1;
+    }
+    return status;
+}
+
+int queries_load(char const *filename, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    int status = 0;
+    if (rank == 0) {
+        if (filename) {
+            status = parse_query_file(filename);
+        } else {
+            struct SearchQuery const grid_query = {g_start_x, g_start_y, g_goal_x, g_goal_y};
+            int capacity = 0;
+            status = push_query(&grid_query, &capacity);
+        }
+    }
+    MPI_Bcast(&status, 1, MPI_INT, 0, comm);
+    if (status != 0) {
+        queries_free();
+        return -1;
+    }
+
+    MPI_Bcast(&g_num_queries, 1, MPI_INT, 0, comm);
+    if (rank != 0) {
+        queries = malloc(g_num_queries * sizeof(*queries));
+    }
+    branches_run = calloc(g_num_queries, sizeof(*branches_run));
+    found_by = malloc(g_num_queries * sizeof(*found_by));
+    if (!queries || !branches_run || !found_by) {
+        tw_error(TW_LOC, "Failed to allocate %d queries", g_num_queries);
+    }
+    MPI_Bcast(queries, g_num_queries * sizeof(*queries), MPI_BYTE, 0, comm);
+    for (int i = 0; i < g_num_queries; i++) {
+        found_by[i] = INT_MAX;
+    }
+
+    if (rank == 0 && filename) {
+        printf("Loaded %d queries from %s\n", g_num_queries, filename);
+    }
+    query_select(0);
+    return 0;
+}
+
+void queries_free(void) {
+    free(queries);
+    free(branches_run);
+    free(found_by);
+    queries = NULL;
+    branches_run = NULL;
+    found_by = NULL;
+    g_num_queries = 0;
+}
+
+void query_select(int query) {
+    assert(query >= 0 && query < g_num_queries);
+    struct SearchQuery const *selected = &queries[query];
+    assert_valid_SearchQuery(selected);
+
+    g_current_query = query;
+    g_start_x = selected->start_x;
+    g_start_y = selected->start_y;
+    g_goal_x = selected->goal_x;
+    g_goal_y = selected->goal_y;
+}
+
+// ================================= Summary ================================
+
+void query_record_branch(int query, bool goal_reached) {
+    assert(query >= 0 && query < g_num_queries);
+    branches_run[query]++;
+    if (goal_reached && found_by[query] == INT_MAX) {
+        found_by[query] = g_tw_mynode;
+    }
+}
+
+void queries_write_summary(MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    int *total_branches = NULL;
+    int *first_found_by = NULL;
+    if (rank == 0) {
+        total_branches = malloc(g_num_queries * sizeof(*total_branches));
+        first_found_by = malloc(g_num_queries * sizeof(*first_found_by));
+        if (!total_branches || !first_found_by) {
+            tw_error(TW_LOC, "Failed to allocate the summary of %d queries", g_num_queries);
+        }
+    }
+    MPI_Reduce(branches_run, total_branches, g_num_queries, MPI_INT, MPI_SUM, 0, comm);
+    MPI_Reduce(found_by, first_found_by, g_num_queries, MPI_INT, MPI_MIN, 0, comm);
+    if (rank != 0) {
+        return;
+    }
+
+    FILE *fp = fopen("search-queries.txt", "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot create query summary file\n");
+    } else {
+        fprintf(fp, "# query start_x start_y goal_x goal_y branches goal_found_by_pe\n");
+        for (int i = 0; i < g_num_queries; i++) {
+            struct SearchQuery const *query = &queries[i];
+            fprintf(fp, "%d %d %d %d %d %d ", i, query->start_x, query->start_y, query->goal_x, query->goal_y,
+                    total_branches[i]);
+            if (first_found_by[i] == INT_MAX) {
+                fprintf(fp, "-\n");
+            } else {
+                fprintf(fp, "%d\n", first_found_by[i]);
+            }
+        }
+        fclose(fp);
+        printf("Query summary written to search-queries.txt\n");
+    }
+    free(total_branches);
+    free(first_found_by);
+}
@@ -0,0 +1,58 @@
+#ifndef SEARCH_QUERY_H
+#define SEARCH_QUERY_H
+
+/** @file
+ * Start/goal queries answered against the same grid in a single run.
+ *
+ * Without a query file there is a single query, the start and goal of the
+ * grid. With one, every query is a separate search: it starts as a branch of
+ * its own on the first group left empty, and its branches carry the query
+ * they belong to. `g_start_x/y` and `g_goal_x/y` always hold the query of the
+ * branch running on this PE (see `query_select`).
+ *
+ * Query files hold one query per line, `start_x start_y goal_x goal_y`. Blank
+ * lines and lines starting with `//` are ignored.
+ */
+
+#include <mpi.h>
+#include <stdbool.h>
+
+/** A start/goal pair. Invariants:
+ * - start and goal lie inside the grid and are not obstacles
+ */
+struct SearchQuery {
+  int start_x, start_y;
+  int goal_x, goal_y;
+};
+
+bool is_valid_SearchQuery(struct SearchQuery const *query);
+
+void assert_valid_SearchQuery(struct SearchQuery const *query);
+
+/** Queries of this run (at least one) */
+extern int g_num_queries;
+
+/** Query of the branch running on this PE */
+extern int g_current_query;
+
+/** Reads the queries in `filename` on rank 0 of `comm` and shares them with
+ * every other rank. A NULL `filename` makes the start and goal of the grid the
+ * only query. Must be called once the grid is loaded. Selects the first query.
+ * Returns 0 on success, and -1 on all ranks otherwise. Collective. */
+int queries_load(char const *filename, MPI_Comm comm);
+
+/** Frees the queries. */
+void queries_free(void);
+
+/** Makes `query` the query of this PE, setting start and goal. */
+void query_select(int query);
+
+/** Records that a branch of `query` finished on this PE, and whether it
+ * reached the goal. */
+void query_record_branch(int query, bool goal_reached);
+
+/** Writes `search-queries.txt` from rank 0 of `comm`: per query, how many
+ * branches it ran and which PE (if any) reached the goal. Collective. */
+void queries_write_summary(MPI_Comm comm);
+
+#endif /* SEARCH_QUERY_H */
@@ -2,7 +2,11 @@
 #include "state.h"
 #include "mapping.h"
 #include "director.h"
+#include "query.h"
+#include "clone_log.h"
+#include "hook_stats.h"
 #include <search_config.h>
+#include <limits.h>
 
 /** Defining LP types.
  * - These are the functions called by ROSS for each LP
@@ -22,11 +26,45 @@ tw_lptype model_lps[] = {
 
 /** Define command line arguments default values. */
 static char grid_map_file[128] = {'\0'};
+static char generate_kind[16] = {'\0'};
+static char query_file[128] = {'\0'};
+static unsigned int gen_width = 256;
+static unsigned int gen_height = 256;
+static double gen_density = 0.3;
+static unsigned long long gen_seed = 42;
+static unsigned int stop_on_first_goal = 0;
+static unsigned int group_size = 1;
+static unsigned int corridor_skip = 0;
+static unsigned int carry_visited = 0;
+static unsigned int aggregate_output = 0;
+static unsigned int clone_log = 0;
+static unsigned int clone_trace = 0;
+static unsigned int one_sided_allocation = 0;
+static unsigned int shared_segment_mb = 4;
+static char spill_dir[128] = {'\0'};
+static char resume_dir[128] = {'\0'};
 
 /** Custom search algorithm command line options. */
 static tw_optdef const model_opts[] = {
     TWOPT_GROUP("Search Algorithm"),
     TWOPT_CHAR("grid-map", grid_map_file, "grid map file path"),
+    TWOPT_CHAR("generate", generate_kind, "generate the grid instead of reading it (open, random, maze or rooms)"),
+    TWOPT_UINT("gen-width", gen_width, "width of the generated grid"),
+    TWOPT_UINT("gen-height", gen_height, "height of the generated grid"),
+    TWOPT_DOUBLE("gen-density", gen_density, "obstacle density of random grids (0 to 1)"),
+    TWOPT_ULONGLONG("gen-seed", gen_seed, "seed of the generated grid"),
+    TWOPT_CHAR("queries", query_file, "file of start/goal queries to answer on the same grid (one 'sx sy gx gy' per line)"),
+    TWOPT_FLAG("stop-on-first-goal", stop_on_first_goal, "stop all PEs as soon as one of them finds the goal"),
+    TWOPT_FLAG("corridor-skip", corridor_skip, "move the agent through corridors (cells with two free neighbours) in one event"),
+    TWOPT_FLAG("carry-visited", carry_visited, "the agent carries the cells it visited instead of cells notifying their neighbours"),
+    TWOPT_FLAG("aggregate-output", aggregate_output, "write the paths of all branches to a single file instead of one file per PE"),
+    TWOPT_FLAG("clone-log", clone_log, "log every branch created (and what happened to it) to search-clones.csv"),
+    TWOPT_FLAG("clone-trace", clone_trace, "write the time, LP states and events of every branch transfer to search-clone-trace.csv"),
+    TWOPT_FLAG("one-sided-allocation", one_sided_allocation, "find empty PEs through an MPI window instead of an allgather in every GVT hook"),
+    TWOPT_UINT("shared-segment-mb", shared_segment_mb, "MiB of shared memory per PE for clones to PEs of the same node (0 sends them as messages)"),
+    TWOPT_CHAR("spill-dir", spill_dir, "write branches that do not fit in the pool to this directory instead of dropping them"),
+    TWOPT_CHAR("resume-dir", resume_dir, "start from the branches an earlier run left in this directory instead of the queries"),
+    TWOPT_UINT("group-size", group_size, "number of ranks simulating each branch (the grid is split among them)"),
     TWOPT_END(),
 };
 
@@ -34,18 +72,46 @@ int main(int argc, char *argv[]) {
     tw_opt_add(model_opts);
     tw_init(&argc, &argv);
 
-    // Check if required grid map file was provided
-    if (grid_map_file[0] == '\0') {
+    // Check that exactly one grid source was provided
+    if ((grid_map_file[0] == '\0') == (generate_kind[0] == '\0')) {
         if (g_tw_mynode == 0) {
-            fprintf(stderr, "Error: --grid-map option is required\n");
+            fprintf(stderr, "Error: exactly one of --grid-map or --generate is required\n");
             fprintf(stderr, "Usage: %s --grid-map=path/to/grid.txt [other options]\n", argv[0]);
+            fprintf(stderr, "       %s --generate=maze --gen-width=1001 --gen-height=1001 [other options]\n", argv[0]);
         }
         tw_end();
         return -1;
     }
 
-    // Configure driver with grid map file
-    driver_config(grid_map_file);
+    // Corridor skipping relies on the notifications sent by the cells
+    if (corridor_skip && carry_visited) {
+        if (g_tw_mynode == 0) {
+            fprintf(stderr, "Error: --corridor-skip cannot be used with --carry-visited\n");
+        }
+        tw_end();
+        return -1;
+    }
+    search_model_config(carry_visited);
+
+    // Configure driver with grid map file or generation parameters
+    if (grid_map_file[0] != '\0') {
+        driver_config(grid_map_file, NULL, corridor_skip, aggregate_output);
+    } else {
+        struct GridGenParams grid_gen = {
+            .width = gen_width > INT_MAX ? INT_MAX : (int) gen_width,
+            .height = gen_height > INT_MAX ? INT_MAX : (int) gen_height,
+            .density = gen_density,
+            .seed = gen_seed,
+        };
+        if (!grid_kind_from_name(generate_kind, &grid_gen.kind)) {
+            if (g_tw_mynode == 0) {
+                fprintf(stderr, "Error: unknown grid kind '%s' (use open, random, maze or rooms)\n", generate_kind);
+            }
+            tw_end();
+            return -1;
+        }
+        driver_config(NULL, &grid_gen, corridor_skip, aggregate_output);
+    }
 
     // Initialize the grid (parse file, allocate memory)
     if (driver_init() != 0) {
@@ -56,27 +122,56 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    // Queries to answer (just the start and goal of the grid without a query file)
+    if (query_file[0] != '\0' && stop_on_first_goal) {
+        if (g_tw_mynode == 0) {
+            fprintf(stderr, "Error: --stop-on-first-goal cannot be used with --queries\n");
+        }
+        tw_end();
+        return -1;
+    }
+    if (queries_load(query_file[0] != '\0' ? query_file : NULL, MPI_COMM_ROSS) != 0) {
+        tw_end();
+        return -1;
+    }
+
     // Print version info
     if (g_tw_mynode == 0) {
         printf("Search algorithm git version: " MODEL_VERSION "\n");
     }
 
+    // Split the grid among the ranks of every clone group
+    if (search_mapping_init(group_size > INT_MAX ? INT_MAX : (int) group_size) != 0) {
+        tw_end();
+        return -1;
+    }
+
     // Initialize director module for decision tracking
+    clone_log_init(clone_log);
+    hook_stats_init(clone_trace);
+    director_config(stop_on_first_goal, one_sided_allocation, (size_t) shared_segment_mb << 20,
+                    spill_dir[0] != '\0' ? spill_dir : NULL, resume_dir[0] != '\0' ? resume_dir : NULL);
     director_init();
 
     // Set up GVT hook for decision tracking
     g_tw_gvt_hook = clone_director_gvt_hook;
     tw_trigger_gvt_hook_when_model_calls();
 
-    // Calculate number of LPs needed (one per grid cell)
-    int total_lps = g_grid_width * g_grid_height;
+    // ROSS expects us to set g_tw_nlp (number of LPs per PE): one per free
+    // cell of the tile of this rank (the whole grid if groups have one rank)
+    g_tw_nlp = search_mapping_num_local_lps();
 
-    // ROSS expects us to set g_tw_nlp (number of LPs per PE)
-    // For simplicity, we'll put all LPs on one PE
-    g_tw_nlp = total_lps;
+    // Ranks of a group hold different numbers of LPs, which the linear
+    // mapping cannot place
+    if (g_tiling.group_size > 1) {
+        g_tw_mapping = CUSTOM;
+        g_tw_custom_initial_mapping = &search_custom_mapping;
+        g_tw_custom_lp_global_to_local_map = &search_mapping_to_lp;
+    }
 
     // Set up LPs within ROSS
-    tw_define_lps(g_tw_nlp, sizeof(struct SearchMessage));
+    // Without carrying visited cells, events leave the trail out
+    tw_define_lps(g_tw_nlp, search_message_size());
 
     // Set the global variable and initialize each LP's type
     g_tw_lp_types = model_lps;
@@ -86,11 +181,26 @@ int main(int argc, char *argv[]) {
     tw_run();
 
     // Write final output (called after all LPs have finished)
-    write_final_output();
+    director_write_final_output();
+    director_spill_pending();
+    if (aggregate_output) {
+        write_aggregated_output(MPI_COMM_ROSS);
+    }
+    if (clone_log) {
+        clone_log_write(MPI_COMM_ROSS);
+    }
+    hook_stats_write(MPI_COMM_ROSS);
+    if (query_file[0] != '\0') {
+        queries_write_summary(MPI_COMM_ROSS);
+    }
 
     // Clean up
-    driver_finalize();
     director_finalize();
+    search_mapping_finalize();
+    queries_free();
+    clone_log_free();
+    hook_stats_free();
+    driver_finalize();
     tw_end();
 
     return 0;
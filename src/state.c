@@ -1,6 +1,9 @@
 #include "state.h"
 #include "director.h"
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // ================================= Global variables ================================
@@ -19,12 +22,265 @@ int g_start_x = -1, g_start_y = -1;
 int g_goal_x = -1, g_goal_y = -1;
 
 // Global grid arrays
-enum CELL_TYPE *g_initial_grid = NULL;
-bool *g_visited_grid = NULL;
-enum DIRECTION *g_exit_dirs = NULL;
+uint64_t const *g_obstacle_plane = NULL;
+uint64_t const *g_corridor_plane = NULL;
+uint64_t const *g_free_cells_before = NULL;
+size_t g_num_free_cells = 0;
+
+// Result pages (NULL until a visited cell falls in them). A cell's byte is its
+// exit direction, plus RESULT_VISITED if it was visited
+#define RESULT_VISITED 0x8
+static uint8_t **result_pages = NULL;
+static size_t num_result_pages = 0;
+
+// Number of dirty LPs in each page of LP_PAGE_SIZE local LPs
+static uint32_t *dirty_lps_per_page = NULL;
+static size_t num_lp_pages = 0;
+
+// Whether the agent carries the cells it visited instead of cells notifying
+// their neighbours (set by `search_model_config`)
+static bool carry_visited = false;
+
+// ================================= Results and LP pages ================================
+
+int results_init(void) {
+    num_result_pages = (grid_num_cells() + RESULT_PAGE_SIZE - 1) / RESULT_PAGE_SIZE;
+    result_pages = calloc(num_result_pages, sizeof(*result_pages));
+    return result_pages ? 0 : -1;
+}
+
+void results_free(void) {
+    if (!result_pages) return;
+    for (size_t page = 0; page < num_result_pages; page++) {
+        free(result_pages[page]);
+    }
+    free(result_pages);
+    result_pages = NULL;
+    num_result_pages = 0;
+}
+
+void results_clear(void) {
+    for (size_t page = 0; page < num_result_pages; page++) {
+        if (result_pages[page]) {
+            memset(result_pages[page], DIRECTION_none, RESULT_PAGE_SIZE);
+        }
+    }
+}
+
+void result_record(int x, int y, enum DIRECTION exit_dir) {
+    size_t const idx = grid_index(x, y);
+    uint8_t **page = &result_pages[idx / RESULT_PAGE_SIZE];
+    if (!*page) {
+        *page = malloc(RESULT_PAGE_SIZE);
+        if (!*page) {
+            tw_error(TW_LOC, "Failed to allocate a result page");
+        }
+        memset(*page, DIRECTION_none, RESULT_PAGE_SIZE);
+    }
+    // The cell where the agent got stuck stays that way. With corridor
+    // skipping, the last cell of a corridor is recorded both by the walk from
+    // the corridor entrance and, if the agent got stuck there, by the cell after
+    uint8_t *result = &(*page)[idx % RESULT_PAGE_SIZE];
+    if (*result != (RESULT_VISITED | DIRECTION_none)) {
+        *result = RESULT_VISITED | exit_dir;
+    }
+}
+
+static uint8_t result_of(int x, int y) {
+    size_t const idx = grid_index(x, y);
+    uint8_t const *page = result_pages[idx / RESULT_PAGE_SIZE];
+    return page ? page[idx % RESULT_PAGE_SIZE] : DIRECTION_none;
+}
+
+bool result_was_visited(int x, int y) {
+    return result_of(x, y) & RESULT_VISITED;
+}
+
+enum DIRECTION result_exit_dir(int x, int y) {
+    return result_of(x, y) & ~RESULT_VISITED;
+}
+
+/** A visited cell, as sent by `results_gather` */
+struct ResultEntry {
+    uint64_t idx;
+    uint8_t result;
+};
+
+void results_gather(MPI_Comm comm) {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    if (size == 1) return;
+
+    // Visited cells of this rank (only allocated pages can hold any)
+    size_t num_entries = 0;
+    for (size_t page = 0; page < num_result_pages; page++) {
+        if (!result_pages[page]) continue;
+        for (size_t i = 0; i < RESULT_PAGE_SIZE; i++) {
+            num_entries += (result_pages[page][i] & RESULT_VISITED) != 0;
+        }
+    }
+    struct ResultEntry *entries = malloc((num_entries > 0 ? num_entries : 1) * sizeof(*entries));
+    if (!entries) {
+        tw_error(TW_LOC, "Failed to allocate %zu result entries", num_entries);
+    }
+    size_t n = 0;
+    for (size_t page = 0; page < num_result_pages; page++) {
+        if (!result_pages[page]) continue;
+        for (size_t i = 0; i < RESULT_PAGE_SIZE; i++) {
+            if (result_pages[page][i] & RESULT_VISITED) {
+                entries[n].idx = page * RESULT_PAGE_SIZE + i;
+                entries[n].result = result_pages[page][i];
+                n++;
+            }
+        }
+    }
+
+    // Entries go as a datatype of their own, so counts and displacements are
+    // in entries rather than bytes, which lets a group gather up to INT_MAX
+    // visited cells (instead of INT_MAX bytes)
+    if (num_entries > INT_MAX) {
+        tw_error(TW_LOC, "Rank %d of the group has %zu visited cells, more than can be gathered (%d)",
+                 rank, num_entries, INT_MAX);
+    }
+    MPI_Datatype entry_type;
+    MPI_Type_contiguous((int) sizeof(struct ResultEntry), MPI_BYTE, &entry_type);
+    MPI_Type_commit(&entry_type);
+
+    int const my_count = (int) num_entries;
+    int counts[size], displs[size];
+    MPI_Gather(&my_count, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+
+    struct ResultEntry *all_entries = NULL;
+    if (rank == 0) {
+        size_t total = 0;
+        for (int r = 0; r < size; r++) {
+            if (total + counts[r] > INT_MAX) {
+                tw_error(TW_LOC, "The group has more than %d visited cells, more than can be gathered", INT_MAX);
+            }
+            displs[r] = (int) total;
+            total += counts[r];
+        }
+        all_entries = malloc((total > 0 ? total : 1) * sizeof(*all_entries));
+        if (!all_entries) {
+            tw_error(TW_LOC, "Failed to allocate %zu gathered result entries", total);
+        }
+    }
+    MPI_Gatherv(entries, my_count, entry_type, all_entries, counts, displs, entry_type, 0, comm);
+    MPI_Type_free(&entry_type);
+    free(entries);
+
+    // Rank 0 already holds its own entries, only the others are recorded
+    if (rank == 0) {
+        for (int r = 1; r < size; r++) {
+            struct ResultEntry const *from = &all_entries[displs[r]];
+            for (int i = 0; i < counts[r]; i++) {
+                int const x = from[i].idx % g_grid_width;
+                int const y = from[i].idx / g_grid_width;
+                result_record(x, y, from[i].result & ~RESULT_VISITED);
+            }
+        }
+        free(all_entries);
+    }
+}
+
+int search_lp_pages_init(size_t nlp) {
+    num_lp_pages = (nlp + LP_PAGE_SIZE - 1) / LP_PAGE_SIZE;
+    dirty_lps_per_page = calloc(num_lp_pages, sizeof(*dirty_lps_per_page));
+    return dirty_lps_per_page || num_lp_pages == 0 ? 0 : -1;
+}
+
+void search_lp_pages_free(void) {
+    free(dirty_lps_per_page);
+    dirty_lps_per_page = NULL;
+    num_lp_pages = 0;
+}
+
+size_t search_lp_num_pages(void) {
+    return num_lp_pages;
+}
+
+bool search_lp_page_is_dirty(size_t page) {
+    return dirty_lps_per_page[page] > 0;
+}
+
+size_t search_lp_num_dirty(void) {
+    size_t num_dirty = 0;
+    for (size_t page = 0; page < num_lp_pages; page++) {
+        num_dirty += dirty_lps_per_page[page];
+    }
+    return num_dirty;
+}
+
+// Keeps the dirty counter of the LP's page up to date across a change of state
+static void update_dirty_count(bool was_dirty, struct SearchCellState const *state, tw_lp *lp) {
+    bool const is_dirty = is_dirty_SearchCellState(state);
+    if (was_dirty != is_dirty) {
+        if (is_dirty) {
+            dirty_lps_per_page[lp->id / LP_PAGE_SIZE]++;
+        } else {
+            dirty_lps_per_page[lp->id / LP_PAGE_SIZE]--;
+        }
+    }
+}
+
+// Wraps `cell_add_changes` for the LP's own state
+static void count_change(struct SearchCellState *state, tw_lp *lp, int delta) {
+    bool const was_dirty = is_dirty_SearchCellState(state);
+    cell_add_changes(state, delta);
+    update_dirty_count(was_dirty, state, lp);
+}
 
 // ================================= Helper functions ================================
 
+void search_model_config(bool carry) {
+    carry_visited = carry;
+}
+
+bool search_model_carries_visited(void) {
+    return carry_visited;
+}
+
+size_t search_message_size(void) {
+    return carry_visited ? sizeof(struct SearchMessage) : offsetof(struct SearchMessage, trail);
+}
+
+// Bit of (x, y) in the trail window, or -1 if it lies outside
+static int trail_bit(struct AgentTrail const *trail, int x, int y) {
+    int const col = x - trail->x0;
+    int const row = y - trail->y0;
+    if (col < 0 || col >= AGENT_TRAIL_SIZE || row < 0 || row >= AGENT_TRAIL_SIZE) {
+        return -1;
+    }
+    return row * AGENT_TRAIL_SIZE + col;
+}
+
+static bool trail_has(struct AgentTrail const *trail, int x, int y) {
+    int const bit = trail_bit(trail, x, y);
+    return bit >= 0 && ((trail->visited >> bit) & 1);
+}
+
+static void trail_mark(struct AgentTrail *trail, int x, int y) {
+    int const bit = trail_bit(trail, x, y);
+    if (bit >= 0) {
+        trail->visited |= UINT64_C(1) << bit;
+    }
+}
+
+// The same trail with (x, y) in the middle of the window. Cells falling out
+// of the window are forgotten
+static struct AgentTrail trail_centered_on(struct AgentTrail const *trail, int x, int y) {
+    struct AgentTrail centered = {x - AGENT_TRAIL_SIZE / 2, y - AGENT_TRAIL_SIZE / 2, 0};
+    for (int row = 0; row < AGENT_TRAIL_SIZE; row++) {
+        for (int col = 0; col < AGENT_TRAIL_SIZE; col++) {
+            if (trail_has(trail, centered.x0 + col, centered.y0 + row)) {
+                centered.visited |= UINT64_C(1) << (row * AGENT_TRAIL_SIZE + col);
+            }
+        }
+    }
+    return centered;
+}
+
 static void get_neighbors(int x, int y, int neighbors[4][2], bool valid[4]) {
     // North, South, East, West
     int dx[] = {0, 0, 1, -1};
@@ -34,7 +290,7 @@ static void get_neighbors(int x, int y, int neighbors[4][2], bool valid[4]) {
         neighbors[i][0] = x + dx[i];
         neighbors[i][1] = y + dy[i];
         valid[i] = is_valid_position(neighbors[i][0], neighbors[i][1]) &&
-                   g_initial_grid[grid_index(neighbors[i][0], neighbors[i][1])] != CELL_TYPE_obstacle;
+                   !grid_is_obstacle(neighbors[i][0], neighbors[i][1]);
     }
 }
 
@@ -48,26 +304,95 @@ static enum DIRECTION opposite_direction(enum DIRECTION dir) {
     }
 }
 
-void send_agent_move(tw_lp *lp, int x, int y, enum DIRECTION direction, double at) {
+static bool is_query_endpoint(int x, int y) {
+    return (x == g_start_x && y == g_start_y) || (x == g_goal_x && y == g_goal_y);
+}
+
+// Follows the corridor starting at (*x, *y), which the agent enters moving
+// towards `*dir`, up to the first cell that is not part of it (a junction, a
+// dead end, or the start or goal of the query). Leaves there the position
+// and the direction of the last step, and returns the number of corridor
+// cells passed. With `record`, every cell passed is recorded in the results
+static int walk_corridor(int *x, int *y, enum DIRECTION *dir, bool record) {
+    // North, South, East, West
+    int dx[] = {0, 0, 1, -1};
+    int dy[] = {-1, 1, 0, 0};
+
+    int length = 0;
+    while (grid_is_corridor(*x, *y) && !is_query_endpoint(*x, *y)) {
+        // A corridor cell has two free neighbours, one of them behind
+        enum DIRECTION const back = opposite_direction(*dir);
+        for (int i = 0; i < 4; i++) {
+            if (i != (int) back && is_valid_position(*x + dx[i], *y + dy[i])
+                && !grid_is_obstacle(*x + dx[i], *y + dy[i])) {
+                *dir = i;
+                break;
+            }
+        }
+        if (record) {
+            result_record(*x, *y, *dir);
+        }
+        *x += dx[*dir];
+        *y += dy[*dir];
+        length++;
+    }
+    return length;
+}
+
+static void send_cell_unavailable_at(tw_lp *lp, int x, int y, enum DIRECTION from_dir, double offset) {
+    tw_lpid const target_gid = g_tiling.group_lp_offset + grid_lp_of_cell(x, y);
+    tw_event *e = tw_event_new(target_gid, offset, lp);
+    struct SearchMessage *msg = tw_event_data(e);
+    msg->type = MESSAGE_TYPE_cell_unavailable;
+    msg->sender = lp->gid;
+    msg->from_dir = from_dir;
+    tw_event_send(e);
+}
+
+void send_agent_move(tw_lp *lp, int x, int y, enum DIRECTION direction, double at, struct AgentTrail const *trail) {
     // North, South, East, West
     int dx[] = {0, 0, 1, -1};
     int dy[] = {-1, 1, 0, 0};
 
     struct SearchCellState *state = (struct SearchCellState *)lp->cur_state;
-    state->exit_dir = direction;
+    cell_set_exit_dir(state, direction);
+
+    int to_x = x + dx[direction];
+    int to_y = y + dy[direction];
+    enum DIRECTION last_step = direction;
+
+    // With corridor skipping, the agent goes straight to the end of the
+    // corridor ahead, arriving when it would have by walking it. The end
+    // learns that the last corridor cell is taken when it would have too.
+    // Cells skipped are rebuilt from this cell's exit in `search_lp_final`
+    int skipped = 0;
+    if (g_corridor_plane) {
+        skipped = walk_corridor(&to_x, &to_y, &last_step, false);
+        if (skipped > 0) {
+            send_cell_unavailable_at(lp, to_x, to_y, opposite_direction(last_step),
+                                     at + skipped - 1 + CELL_UNAVAILABLE_DELAY - tw_now(lp));
+        }
+    }
 
-    double const offset = at - tw_now(lp);
-    tw_lpid const target_gid = g_tw_lp_offset + grid_index(x + dx[direction], y + dy[direction]);
+    double const offset = at + skipped - tw_now(lp);
+    tw_lpid const target_gid = g_tiling.group_lp_offset + grid_lp_of_cell(to_x, to_y);
 
     tw_event *e = tw_event_new(target_gid, offset, lp);
     struct SearchMessage *msg = tw_event_data(e);
     msg->type = MESSAGE_TYPE_agent_move;
     msg->sender = lp->gid;
+    msg->from_dir = opposite_direction(last_step);
+    if (carry_visited) {
+        struct AgentTrail left = *trail;
+        trail_mark(&left, x, y);
+        msg->trail = trail_centered_on(&left, to_x, to_y);
+    }
     tw_event_send(e);
 }
 
-static void send_agent_move_cloning(tw_lp *lp, int x, int y, enum DIRECTION option1, enum DIRECTION option2) {
-    director_store_decision(x, y, option1, option2, tw_now(lp));
+static void send_agent_move_cloning(tw_lp *lp, int x, int y, enum DIRECTION option1, enum DIRECTION option2,
+                                    struct AgentTrail const *trail) {
+    director_store_decision(x, y, option1, option2, tw_now(lp), trail);
     tw_trigger_gvt_hook_now(lp);
 }
 
@@ -76,52 +401,103 @@ static void send_agent_move_cloning_rev(tw_lp *lp, int x, int y) {
     tw_trigger_gvt_hook_now_rev(lp);
 }
 
-static void send_cell_unavailable(tw_lp *lp, int x, int y, enum DIRECTION direction) {
-    // North, South, East, West
-    int dx[] = {0, 0, 1, -1};
-    int dy[] = {-1, 1, 0, 0};
+void send_agent_start(tw_lp *lp) {
+    tw_event *e = tw_event_new(lp->gid, 1.0, lp);
+    struct SearchMessage *msg = tw_event_data(e);
+    msg->type = MESSAGE_TYPE_agent_move;
+    msg->sender = lp->gid;
+    msg->from_dir = DIRECTION_none;
+    if (carry_visited) {
+        msg->trail = (struct AgentTrail) {
+            cell_x_of_lp(lp) - AGENT_TRAIL_SIZE / 2, cell_y_of_lp(lp) - AGENT_TRAIL_SIZE / 2, 0
+        };
+    }
+    tw_event_send(e);
+}
 
-    tw_lpid const target_gid = g_tw_lp_offset + grid_index(x + dx[direction], y + dy[direction]);
-    tw_event *e = tw_event_new(target_gid, 0.5, lp);
+// Sends the agent that `msg` brought to the (visited) cell (x, y) back where
+// it came from, now knowing that this cell is taken
+static void send_agent_bounce(tw_lp *lp, int x, int y, struct SearchMessage const *msg) {
+    int neighbors[4][2];
+    bool valid[4];
+    get_neighbors(x, y, neighbors, valid);
+
+    struct AgentTrail trail = msg->trail;
+    trail_mark(&trail, x, y);
+
+    tw_event *e = tw_event_new(msg->sender, CELL_UNAVAILABLE_DELAY, lp);
+    struct SearchMessage *bounce = tw_event_data(e);
+    bounce->type = MESSAGE_TYPE_agent_bounce;
+    bounce->sender = lp->gid;
+    bounce->from_dir = opposite_direction(msg->from_dir);
+    bounce->trail = trail_centered_on(&trail, neighbors[msg->from_dir][0], neighbors[msg->from_dir][1]);
+    tw_event_send(e);
+}
+
+// The director only recycles a group from a GVT hook, and hooks are only
+// triggered by the model. This event makes sure one happens once the branch
+// is over, instead of waiting for a decision elsewhere
+static void send_branch_end(tw_lp *lp) {
+    tw_event *e = tw_event_new(lp->gid, CELL_UNAVAILABLE_DELAY + 1.0, lp);
     struct SearchMessage *msg = tw_event_data(e);
-    msg->type = MESSAGE_TYPE_cell_unavailable;
+    msg->type = MESSAGE_TYPE_branch_end;
     msg->sender = lp->gid;
-    msg->from_dir = opposite_direction(direction);
     tw_event_send(e);
 }
 
-// ================================= Message handlers ================================
+// A resumed run has no agent to start, so nothing would ever trigger the GVT
+// hook where the director starts the branches read from disk
+static void send_resume(tw_lp *lp) {
+    tw_event *e = tw_event_new(lp->gid, 1.0, lp);
+    struct SearchMessage *msg = tw_event_data(e);
+    msg->type = MESSAGE_TYPE_resume;
+    msg->sender = lp->gid;
+    tw_event_send(e);
+}
 
-static void handle_agent_move(struct SearchCellState *state, tw_bf *bf, struct SearchMessage *msg, tw_lp *lp) {
-    assert(!state->was_visited);
+static void send_cell_unavailable(tw_lp *lp, int x, int y, enum DIRECTION direction) {
+    // North, South, East, West
+    int dx[] = {0, 0, 1, -1};
+    int dy[] = {-1, 1, 0, 0};
 
-    // Agent arrives at this cell
-    state->was_visited = true;
+    send_cell_unavailable_at(lp, x + dx[direction], y + dy[direction], opposite_direction(direction),
+                             CELL_UNAVAILABLE_DELAY);
+}
 
-    // If this is the goal, we're done!
-    if (state->cell_type == CELL_TYPE_goal) {
-        bf->c0 = 1;
-        return;
-    }
+// ================================= Message handlers ================================
 
-    // Try to move to next cell
-    enum DIRECTION available_moves[4];
-    int num_moves = 0;
+// Directions the agent can take from (x, y): free neighbours not known to be
+// taken, either from notifications or from the trail the agent carries
+static int available_moves_from(struct SearchCellState const *state, struct SearchMessage const *msg,
+                                int x, int y, enum DIRECTION available_moves[4]) {
+    int neighbors[4][2];
+    bool valid[4];
+    get_neighbors(x, y, neighbors, valid);
 
+    int num_moves = 0;
     for (int i = 0; i < 4; i++) {
-        if (state->available_dirs[i]) {
+        if (cell_is_available(state, i)
+            && !(carry_visited && trail_has(&msg->trail, neighbors[i][0], neighbors[i][1]))) {
             available_moves[num_moves++] = i;
         }
     }
+    return num_moves;
+}
 
+// Sends the agent on from (x, y), given the directions it can take. `trail`
+// is NULL unless carrying visited cells
+static void move_agent_on(struct SearchCellState *state, tw_bf *bf, tw_lp *lp, int x, int y,
+                          enum DIRECTION const available_moves[4], int num_moves, struct AgentTrail const *trail) {
     if (num_moves == 1) {
         // Only one choice - no random number needed
         enum DIRECTION dir = available_moves[0];
 
         // Send agent to next cell
-        send_agent_move(lp, state->x, state->y, dir, tw_now(lp) + 1.0);
+        send_agent_move(lp, x, y, dir, tw_now(lp) + 1.0, trail);
         // Informing cell is no longer available
-        send_cell_unavailable(lp, state->x, state->y, dir);
+        if (!carry_visited) {
+            send_cell_unavailable(lp, x, y, dir);
+        }
     } else if (num_moves > 1) {
         bf->c1 = 1;
         // Pick random direction from multiple options
@@ -136,60 +512,151 @@ static void handle_agent_move(struct SearchCellState *state, tw_bf *bf, struct S
             if (choice <= choice_2nd) { choice_2nd += 1; }
             enum DIRECTION const dir_2nd = available_moves[choice_2nd];
 
-            send_agent_move_cloning(lp, state->x, state->y, dir, dir_2nd);
+            send_agent_move_cloning(lp, x, y, dir, dir_2nd, trail);
         } else {
-            send_agent_move(lp, state->x, state->y, dir, tw_now(lp) + 1.0);
+            send_agent_move(lp, x, y, dir, tw_now(lp) + 1.0, trail);
         }
 
         // Telling neighbors, this cell is no longer available
-        for (int i = 0; i < num_moves; i++) {
-            send_cell_unavailable(lp, state->x, state->y, available_moves[i]);
+        if (!carry_visited) {
+            for (int i = 0; i < num_moves; i++) {
+                send_cell_unavailable(lp, x, y, available_moves[i]);
+            }
         }
     } else {
         bf->c2 = 1;
         // No moves available - agent is stuck
-        state->exit_dir = DIRECTION_none;
+        cell_set_exit_dir(state, DIRECTION_none);
+        send_branch_end(lp);
     }
 }
 
-static void handle_cell_unavailable(struct SearchCellState *state, tw_bf *bf, struct SearchMessage *msg, tw_lp *lp) {
-    bf->c3 = state->available_dirs[msg->from_dir];
-    state->available_dirs[msg->from_dir] = false;
+static void move_agent_on_rev(tw_bf *bf, tw_lp *lp) {
+    if (bf->c1) {
+        tw_rand_reverse_unif(lp->rng);
+        tw_rand_reverse_unif(lp->rng);
+        if (bf->c4) {
+            tw_rand_reverse_unif(lp->rng);
+            send_agent_move_cloning_rev(lp, cell_x_of_lp(lp), cell_y_of_lp(lp));
+        }
+    }
 }
 
-// ================================= ROSS LP functions ===============================
+static void handle_agent_move(struct SearchCellState *state, tw_bf *bf, struct SearchMessage *msg, tw_lp *lp) {
+    int const x = cell_x_of_lp(lp);
+    int const y = cell_y_of_lp(lp);
+
+    if (cell_was_visited(state)) {
+        // Only when carrying visited cells: the trail had forgotten this
+        // cell, so the agent goes back to pick another way
+        if (carry_visited) {
+            bf->c6 = 1;
+            send_agent_bounce(lp, x, y, msg);
+            return;
+        }
 
-void search_lp_init(struct SearchCellState *state, tw_lp *lp) {
-    // Initialize from global grid
-    if (!g_initial_grid) {
-        fprintf(stderr, "Error: Grid not loaded!\n");
+        // Only with corridor skipping: the corridor led back to a visited
+        // cell, so the agent got stuck in its last cell (which never learned
+        // that this cell was taken)
+        assert(g_corridor_plane && msg->from_dir != DIRECTION_none);
+        bf->c5 = 1;
+        cell_set_stuck_before(state, msg->from_dir);
+        count_change(state, lp, +1);
+        send_branch_end(lp);
+        return;
+    }
+
+    // Agent arrives at this cell
+    cell_set_visited(state, true);
+    count_change(state, lp, +1);
+
+    // If this is the goal, we're done! (the goal of the query of this
+    // branch, cell types only know the query the LPs were initialized with)
+    if (x == g_goal_x && y == g_goal_y) {
+        bf->c0 = 1;
+        director_goal_reached(lp);
+        send_branch_end(lp);
         return;
     }
 
-    state->y = lp->id / g_grid_width;
-    state->x = lp->id % g_grid_width;
-    state->cell_type = g_initial_grid[grid_index(state->x, state->y)];
-    state->was_visited = false;
-    state->exit_dir = DIRECTION_none;
+    // Try to move to next cell
+    enum DIRECTION available_moves[4];
+    int const num_moves = available_moves_from(state, msg, x, y, available_moves);
+    move_agent_on(state, bf, lp, x, y, available_moves, num_moves, carry_visited ? &msg->trail : NULL);
+}
+
+// The agent left this cell towards `from_dir` and found a visited cell there
+static void handle_agent_bounce(struct SearchCellState *state, tw_bf *bf, struct SearchMessage *msg, tw_lp *lp) {
+    assert(carry_visited && cell_was_visited(state) && cell_get_exit_dir(state) == msg->from_dir);
+    int const x = cell_x_of_lp(lp);
+    int const y = cell_y_of_lp(lp);
+    count_change(state, lp, +1);
+
+    enum DIRECTION available_moves[4];
+    int const num_moves = available_moves_from(state, msg, x, y, available_moves);
+    move_agent_on(state, bf, lp, x, y, available_moves, num_moves, &msg->trail);
+}
+
+static void handle_cell_unavailable(struct SearchCellState *state, tw_bf *bf, struct SearchMessage *msg, tw_lp *lp) {
+    bf->c3 = cell_is_available(state, msg->from_dir);
+    cell_set_available(state, msg->from_dir, false);
+    if (bf->c3) {
+        count_change(state, lp, +1);
+    }
+}
+
+// ================================= ROSS LP functions ===============================
+
+void search_lp_reset_state(struct SearchCellState *state, tw_lp *lp) {
+    int const x = cell_x_of_lp(lp);
+    int const y = cell_y_of_lp(lp);
+
+    bool const was_dirty = is_dirty_SearchCellState(state);
+    state->bits = 0;
+    cell_set_type(state, grid_cell_type(x, y));
+    cell_set_visited(state, false);
+    cell_set_exit_dir(state, DIRECTION_none);
 
     // Initialize available directions based on neighbors
     int neighbors[4][2];
     bool valid[4];
-    get_neighbors(state->x, state->y, neighbors, valid);
+    get_neighbors(x, y, neighbors, valid);
 
     for (int i = 0; i < 4; i++) {
-        state->available_dirs[i] = valid[i];
+        cell_set_available(state, i, valid[i]);
+    }
+
+    update_dirty_count(was_dirty, state, lp);
+    assert_valid_SearchCellState(state);
+}
+
+void search_lp_restore_state(struct SearchCellState *state, tw_lp *lp, struct SearchCellState const *saved) {
+    bool const was_dirty = is_dirty_SearchCellState(state);
+    *state = *saved;
+    update_dirty_count(was_dirty, state, lp);
+    assert_valid_SearchCellState(state);
+}
+
+void search_lp_init(struct SearchCellState *state, tw_lp *lp) {
+    // Initialize from global grid
+    if (!g_obstacle_plane) {
+        fprintf(stderr, "Error: Grid not loaded!\n");
+        return;
     }
 
+    state->bits = 0;
+    search_lp_reset_state(state, lp);
+
     // If this is the start cell, place the agent here
-    if (state->x == g_start_x && state->y == g_start_y && g_tw_mynode == 0) {
-        // Schedule first move after a small delay
-        tw_event *e = tw_event_new(lp->gid, 1.0, lp);
-        struct SearchMessage *msg = tw_event_data(e);
-        msg->type = MESSAGE_TYPE_agent_move;
-        msg->sender = lp->gid;
-        msg->from_dir = DIRECTION_none;
-        tw_event_send(e);
+    // (the first branch runs on the first group). Resumed runs start from the
+    // branches on disk instead
+    if (director_is_resuming()) {
+        if (g_tw_mynode == 0 && lp->id == 0) {
+            send_resume(lp);
+        }
+    } else if (cell_x_of_lp(lp) == g_start_x && cell_y_of_lp(lp) == g_start_y
+               && g_tw_mynode < (tw_peid) g_tiling.group_size) {
+        send_agent_start(lp);
     }
 
     assert_valid_SearchCellState(state);
@@ -204,28 +671,52 @@ void search_lp_event_handler(struct SearchCellState *state, tw_bf *bf, struct Se
         case MESSAGE_TYPE_cell_unavailable:
             handle_cell_unavailable(state, bf, msg, lp);
             break;
+        case MESSAGE_TYPE_branch_end:
+        case MESSAGE_TYPE_resume:
+            tw_trigger_gvt_hook_now(lp);
+            break;
+        case MESSAGE_TYPE_agent_bounce:
+            handle_agent_bounce(state, bf, msg, lp);
+            break;
     }
 
     assert_valid_SearchCellState(state);
-    assert_valid_SearchMessage(msg);
+    assert_valid_SearchMessage(msg, lp);
 }
 
 void search_lp_event_rev_handler(struct SearchCellState *state, tw_bf *bf, struct SearchMessage *msg, tw_lp *lp) {
     switch (msg->type) {
         case MESSAGE_TYPE_agent_move:
-            state->was_visited = false;
-            state->exit_dir = DIRECTION_none;
-            if (bf->c1) {
-                tw_rand_reverse_unif(lp->rng);
-                tw_rand_reverse_unif(lp->rng);
-                if (bf->c4) {
-                    tw_rand_reverse_unif(lp->rng);
-                    send_agent_move_cloning_rev(lp, state->x, state->y);
-                }
+            if (bf->c6) {
+                break;
+            }
+            if (bf->c5) {
+                cell_set_stuck_before(state, DIRECTION_none);
+                count_change(state, lp, -1);
+                break;
             }
+            cell_set_visited(state, false);
+            cell_set_exit_dir(state, DIRECTION_none);
+            count_change(state, lp, -1);
+            if (bf->c0) {
+                director_goal_reached_rev(lp);
+            }
+            move_agent_on_rev(bf, lp);
+            break;
+        case MESSAGE_TYPE_agent_bounce:
+            cell_set_exit_dir(state, msg->from_dir);
+            count_change(state, lp, -1);
+            move_agent_on_rev(bf, lp);
             break;
         case MESSAGE_TYPE_cell_unavailable:
-            state->available_dirs[msg->from_dir] = bf->c3;
+            cell_set_available(state, msg->from_dir, bf->c3);
+            if (bf->c3) {
+                count_change(state, lp, -1);
+            }
+            break;
+        case MESSAGE_TYPE_branch_end:
+        case MESSAGE_TYPE_resume:
+            tw_trigger_gvt_hook_now_rev(lp);
             break;
     }
     assert_valid_SearchCellState(state);
@@ -234,11 +725,22 @@ void search_lp_event_rev_handler(struct SearchCellState *state, tw_bf *bf, struc
 void search_lp_event_commit(struct SearchCellState *state, tw_bf *bf, struct SearchMessage *msg, tw_lp *lp) {
     switch (msg->type) {
         case MESSAGE_TYPE_agent_move:
+        case MESSAGE_TYPE_agent_bounce:
             if (bf->c0) {
-                printf("PE %d - Goal found at (%d,%d) at time %.2f!\n", (int)g_tw_mynode, state->x, state->y, tw_now(lp));
+                printf("PE %d - Goal found at (%d,%d) at time %.2f!\n", (int)g_tw_mynode, cell_x_of_lp(lp), cell_y_of_lp(lp), tw_now(lp));
             }
             if (bf->c2) {
-                printf("PE %d - Agent stuck at (%d,%d) at time %.2f\n", (int)g_tw_mynode, state->x, state->y, tw_now(lp));
+                printf("PE %d - Agent stuck at (%d,%d) at time %.2f\n", (int)g_tw_mynode, cell_x_of_lp(lp), cell_y_of_lp(lp), tw_now(lp));
+            }
+            if (bf->c5) {
+                int neighbors[4][2];
+                bool valid[4];
+                get_neighbors(cell_x_of_lp(lp), cell_y_of_lp(lp), neighbors, valid);
+                printf("PE %d - Agent stuck at (%d,%d) at time %.2f\n", (int)g_tw_mynode,
+                       neighbors[msg->from_dir][0], neighbors[msg->from_dir][1], tw_now(lp) - 1.0);
+            }
+            if (bf->c0 || bf->c2 || bf->c5) {
+                director_branch_finished(tw_now(lp));
             }
             break;
         default:
@@ -247,10 +749,30 @@ void search_lp_event_commit(struct SearchCellState *state, tw_bf *bf, struct Sea
 }
 
 void search_lp_final(struct SearchCellState *state, tw_lp *lp) {
-    // Write final state to global grid
-    int idx = grid_index(state->x, state->y);
-    g_visited_grid[idx] = state->was_visited;
-    g_exit_dirs[idx] = state->exit_dir;
-
     assert_valid_SearchCellState(state);
+
+    int const x = cell_x_of_lp(lp);
+    int const y = cell_y_of_lp(lp);
+
+    // Only visited cells are recorded, anything else reads as unvisited
+    if (cell_was_visited(state)) {
+        enum DIRECTION exit_dir = cell_get_exit_dir(state);
+        result_record(x, y, exit_dir);
+
+        // Corridor cells the agent skipped from here
+        if (g_corridor_plane && exit_dir != DIRECTION_none) {
+            int neighbors[4][2];
+            bool valid[4];
+            get_neighbors(x, y, neighbors, valid);
+            walk_corridor(&neighbors[exit_dir][0], &neighbors[exit_dir][1], &exit_dir, true);
+        }
+    }
+
+    enum DIRECTION const stuck_side = cell_get_stuck_before(state);
+    if (stuck_side != DIRECTION_none) {
+        int neighbors[4][2];
+        bool valid[4];
+        get_neighbors(x, y, neighbors, valid);
+        result_record(neighbors[stuck_side][0], neighbors[stuck_side][1], DIRECTION_none);
+    }
 }
@@ -6,12 +6,20 @@
  */
 
 #include <ross.h>
+#include <search_config.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 
-/** Maximum dimensions for the search grid */
-#define MAX_GRID_WIDTH 100
-#define MAX_GRID_HEIGHT 100
+/** Delay between an agent leaving a cell and its neighbours learning that the
+ * cell is no longer available. No event of a branch is scheduled later than
+ * this after the agent stops. */
+#define CELL_UNAVAILABLE_DELAY 0.5
+
+/** Maximum dimensions for the search grid (set at configuration time, see
+ * SEARCH_MAX_GRID_WIDTH and SEARCH_MAX_GRID_HEIGHT in CMake) */
+#define MAX_GRID_WIDTH SEARCH_MAX_GRID_WIDTH
+#define MAX_GRID_HEIGHT SEARCH_MAX_GRID_HEIGHT
 
 // ================================ Enums ===================================
 
@@ -40,93 +48,397 @@ extern int g_grid_height;
 extern int g_start_x, g_start_y;
 extern int g_goal_x, g_goal_y;
 
-/** Global grid arrays for initial state and final results (shared per PE) */
-extern enum CELL_TYPE *g_initial_grid;  /**< Initial grid layout (read at init) */
-extern bool *g_visited_grid;           /**< Final: which cells were visited (written at finalize) */
-extern enum DIRECTION *g_exit_dirs;    /**< Final: exit direction from each cell (written at finalize) */
+/** Initial grid layout (read-only once loaded, see grid_map.h). One bit per
+ * cell, set for obstacles: cell `i = grid_index(x, y)` is bit `i % 64` of word
+ * `i / 64`. Start and goal are only stored as coordinates. */
+extern uint64_t const *g_obstacle_plane;
+
+/** Corridor cells (free cells with exactly two free neighbours), in the same
+ * layout as `g_obstacle_plane`. NULL unless corridor skipping is on, in which
+ * case an agent entering a corridor goes straight to its end (see
+ * `send_agent_move`). */
+extern uint64_t const *g_corridor_plane;
+
+/** Final results of a branch (which cells were visited and the direction the
+ * agent exited them), written by `search_lp_final`. Stored in pages of
+ * RESULT_PAGE_SIZE cells that are allocated the first time a visited cell
+ * falls in them. Cells in missing pages read as unvisited. */
+#define RESULT_PAGE_SIZE 4096
 
 // ================================ State struct ===============================
 
 /** State for each cell LP in the search simulation.
- * Each LP represents one cell in the grid.
+ * Each LP represents one free cell in the grid (obstacles have no LP). The
+ * cell coordinates are not stored, they are looked up from the LP id (see
+ * `cell_x_of_lp`/`cell_y_of_lp`).
+ * Everything else is packed in 16 bits, which keeps the ROSS state arena small
+ * and every clone transfer cheap. Use the `cell_*` accessors below instead of
+ * touching `bits` directly. Bit layout:
+ * - bits 0-3: which directions are available (N,S,E,W)
+ * - bit 4: whether agent has visited this cell
+ * - bits 5-7: direction agent exited, for path reconstruction (0 <= exit_dir <= DIRECTION_none)
+ * - bits 8-9: type of this cell (`enum CELL_TYPE`)
+ * - bits 10-12: number of processed events that modified this cell. Zero means
+ *   the cell is untouched since `search_lp_init` (0 <= num_changes <= 6)
+ * - bits 13-15: with corridor skipping, the side of this (already visited)
+ *   cell where a corridor ended in which the agent got stuck, plus one. Zero
+ *   otherwise (0 <= stuck_before <= 4)
  */
 struct SearchCellState {
-  int x, y;                    /**< Cell coordinates */
-  enum CELL_TYPE cell_type;     /**< Type of this cell */
-  bool available_dirs[4];      /**< Which directions are available (N,S,E,W) */
-  bool was_visited;            /**< Whether agent has visited this cell */
-  enum DIRECTION exit_dir;     /**< Direction agent exited (for path reconstruction) */
+  uint16_t bits;
 };
 
-/** Helper functions for global grid access */
-static inline int grid_index(int x, int y) {
-    return y * g_grid_width + x;
+#define CELL_AVAILABLE_SHIFT 0
+#define CELL_AVAILABLE_MASK  (0xFu << CELL_AVAILABLE_SHIFT)
+#define CELL_VISITED_SHIFT   4
+#define CELL_VISITED_MASK    (0x1u << CELL_VISITED_SHIFT)
+#define CELL_EXIT_DIR_SHIFT  5
+#define CELL_EXIT_DIR_MASK   (0x7u << CELL_EXIT_DIR_SHIFT)
+#define CELL_TYPE_SHIFT      8
+#define CELL_TYPE_MASK       (0x3u << CELL_TYPE_SHIFT)
+#define CELL_CHANGES_SHIFT   10
+#define CELL_CHANGES_MASK    (0x7u << CELL_CHANGES_SHIFT)
+#define CELL_STUCK_SHIFT     13
+#define CELL_STUCK_MASK      (0x7u << CELL_STUCK_SHIFT)
+
+/** Helper functions for global grid access. Indices are 64-bit, as big
+ * grids easily go past 2^31 cells */
+static inline size_t grid_index(int x, int y) {
+    return (size_t) y * g_grid_width + x;
+}
+
+static inline size_t grid_num_cells(void) {
+    return (size_t) g_grid_width * g_grid_height;
 }
 
 static inline bool is_valid_position(int x, int y) {
     return x >= 0 && x < g_grid_width && y >= 0 && y < g_grid_height;
 }
 
-static inline bool is_valid_SearchCellState(struct SearchCellState *s) {
-    return s->x >= 0 && s->x < g_grid_width &&
-           s->y >= 0 && s->y < g_grid_height &&
-           s->cell_type >= CELL_TYPE_free && s->cell_type <= CELL_TYPE_goal &&
-           s->exit_dir >= DIRECTION_north && s->exit_dir <= DIRECTION_none;
+static inline bool grid_is_obstacle(int x, int y) {
+    size_t const idx = grid_index(x, y);
+    return (g_obstacle_plane[idx / 64] >> (idx % 64)) & 1;
+}
+
+static inline bool grid_is_corridor(int x, int y) {
+    size_t const idx = grid_index(x, y);
+    return (g_corridor_plane[idx / 64] >> (idx % 64)) & 1;
+}
+
+/** Initial type of a cell */
+static inline enum CELL_TYPE grid_cell_type(int x, int y) {
+    if (grid_is_obstacle(x, y)) return CELL_TYPE_obstacle;
+    if (x == g_start_x && y == g_start_y) return CELL_TYPE_start;
+    if (x == g_goal_x && y == g_goal_y) return CELL_TYPE_goal;
+    return CELL_TYPE_free;
+}
+
+/** Free cells. Only free cells (anything but obstacles) get an LP. Built
+ * once the grid is loaded (see `grid_map_index_free_cells`) */
+extern uint64_t const *g_free_cells_before;  /**< Per plane word (plus one past the last), number of free cells in all earlier words */
+extern size_t g_num_free_cells;
+
+/** Number of free cells with a `grid_index` lower than `idx` (0 <= idx <= grid_num_cells()) */
+static inline uint64_t grid_free_cells_before(size_t idx) {
+    if (idx % 64 == 0) {
+        return g_free_cells_before[idx / 64];
+    }
+    uint64_t const below = (UINT64_C(1) << (idx % 64)) - 1;
+    return g_free_cells_before[idx / 64] + __builtin_popcountll(~g_obstacle_plane[idx / 64] & below);
+}
+
+/** Split of the grid among the ranks of a clone group (see mapping.h). Every
+ * branch is simulated by a group of `group_size` consecutive ranks. The grid
+ * is cut into `tiles_x` by `tiles_y` tiles, and tile `t` (in row-major order)
+ * belongs to member `t` of the group. Tile column `tx` covers the cells
+ * `tile_x0(tx) <= x < tile_x0(tx + 1)`, and likewise for rows.
+ *
+ * Within a group, LPs are numbered tile by tile, and within a tile in the
+ * row-major order of its free cells. Invariants:
+ * - tiles_x * tiles_y == group_size, 1 <= tiles_x <= g_grid_width, 1 <= tiles_y <= g_grid_height
+ * - lp_base[t] is the number of free cells in the tiles before `t`
+ *   (lp_base[0] == 0, lp_base[group_size] == g_num_free_cells)
+ * - row_prefix[row_offset[t] + r] is the number of free cells in the first `r`
+ *   rows of tile `t`
+ * - group_lp_offset is the gid of the first LP of this rank's group
+ */
+struct GridTiling {
+  int group_size;
+  int tiles_x, tiles_y;
+  uint64_t *lp_base;
+  size_t *row_offset;
+  uint64_t *row_prefix;
+  tw_lpid group_lp_offset;
+};
+
+extern struct GridTiling g_tiling;
+
+/** Per local LP, the `grid_index` of its cell */
+extern size_t const *g_lp_cell;
+
+static inline int tile_x0(int tx) {
+    return (int64_t) tx * g_grid_width / g_tiling.tiles_x;
+}
+
+static inline int tile_y0(int ty) {
+    return (int64_t) ty * g_grid_height / g_tiling.tiles_y;
+}
+
+/** Tile (and thus group member) a cell belongs to */
+static inline int tile_of_cell(int x, int y) {
+    int const tx = (((int64_t) x + 1) * g_tiling.tiles_x + g_grid_width - 1) / g_grid_width - 1;
+    int const ty = (((int64_t) y + 1) * g_tiling.tiles_y + g_grid_height - 1) / g_grid_height - 1;
+    return ty * g_tiling.tiles_x + tx;
 }
 
-static inline void assert_valid_SearchCellState(struct SearchCellState *s) {
+/** LP of a (free) cell, relative to the first LP of the group: the free cells
+ * of the tiles before, plus those in the rows of its tile above it, plus
+ * those to its left in its row */
+static inline tw_lpid grid_lp_of_cell(int x, int y) {
+    assert(!grid_is_obstacle(x, y));
+    int const tile = tile_of_cell(x, y);
+    int const tx = tile % g_tiling.tiles_x;
+    int const ty = tile / g_tiling.tiles_x;
+    return g_tiling.lp_base[tile]
+         + g_tiling.row_prefix[g_tiling.row_offset[tile] + (y - tile_y0(ty))]
+         + grid_free_cells_before(grid_index(x, y))
+         - grid_free_cells_before(grid_index(tile_x0(tx), y));
+}
+
+/** Cell coordinates of an LP */
+static inline int cell_x_of_lp(tw_lp const *lp) {
+    return g_lp_cell[lp->id] % g_grid_width;
+}
+
+static inline int cell_y_of_lp(tw_lp const *lp) {
+    return g_lp_cell[lp->id] / g_grid_width;
+}
+
+/** Accessors for the packed cell state */
+static inline unsigned int cell_get_field(struct SearchCellState const *s, unsigned int mask, unsigned int shift) {
+    return (s->bits & mask) >> shift;
+}
+
+static inline void cell_set_field(struct SearchCellState *s, unsigned int mask, unsigned int shift, unsigned int value) {
+    s->bits = (s->bits & ~mask) | ((value << shift) & mask);
+}
+
+static inline bool cell_is_available(struct SearchCellState const *s, enum DIRECTION dir) {
+    return s->bits & (1u << (CELL_AVAILABLE_SHIFT + dir));
+}
+
+static inline void cell_set_available(struct SearchCellState *s, enum DIRECTION dir, bool available) {
+    cell_set_field(s, 1u << (CELL_AVAILABLE_SHIFT + dir), CELL_AVAILABLE_SHIFT + dir, available);
+}
+
+static inline bool cell_was_visited(struct SearchCellState const *s) {
+    return cell_get_field(s, CELL_VISITED_MASK, CELL_VISITED_SHIFT);
+}
+
+static inline void cell_set_visited(struct SearchCellState *s, bool visited) {
+    cell_set_field(s, CELL_VISITED_MASK, CELL_VISITED_SHIFT, visited);
+}
+
+static inline enum DIRECTION cell_get_exit_dir(struct SearchCellState const *s) {
+    return cell_get_field(s, CELL_EXIT_DIR_MASK, CELL_EXIT_DIR_SHIFT);
+}
+
+static inline void cell_set_exit_dir(struct SearchCellState *s, enum DIRECTION dir) {
+    cell_set_field(s, CELL_EXIT_DIR_MASK, CELL_EXIT_DIR_SHIFT, dir);
+}
+
+static inline enum CELL_TYPE cell_get_type(struct SearchCellState const *s) {
+    return cell_get_field(s, CELL_TYPE_MASK, CELL_TYPE_SHIFT);
+}
+
+static inline void cell_set_type(struct SearchCellState *s, enum CELL_TYPE type) {
+    cell_set_field(s, CELL_TYPE_MASK, CELL_TYPE_SHIFT, type);
+}
+
+/** Side where the agent got stuck just before reaching this cell (DIRECTION_none if it did not) */
+static inline enum DIRECTION cell_get_stuck_before(struct SearchCellState const *s) {
+    unsigned int const side = cell_get_field(s, CELL_STUCK_MASK, CELL_STUCK_SHIFT);
+    return side == 0 ? DIRECTION_none : side - 1;
+}
+
+static inline void cell_set_stuck_before(struct SearchCellState *s, enum DIRECTION side) {
+    cell_set_field(s, CELL_STUCK_MASK, CELL_STUCK_SHIFT, side == DIRECTION_none ? 0 : side + 1);
+}
+
+static inline int cell_get_num_changes(struct SearchCellState const *s) {
+    return cell_get_field(s, CELL_CHANGES_MASK, CELL_CHANGES_SHIFT);
+}
+
+/** Adds `delta` (+1 or -1) to the number of changes of the cell */
+static inline void cell_add_changes(struct SearchCellState *s, int delta) {
+    cell_set_field(s, CELL_CHANGES_MASK, CELL_CHANGES_SHIFT, cell_get_num_changes(s) + delta);
+}
+
+static inline bool is_valid_SearchCellState(struct SearchCellState const *s) {
+    return cell_get_exit_dir(s) <= DIRECTION_none &&
+           cell_get_num_changes(s) <= 6 &&
+           cell_get_field(s, CELL_STUCK_MASK, CELL_STUCK_SHIFT) <= 4;
+}
+
+static inline void assert_valid_SearchCellState(struct SearchCellState const *s) {
 #ifndef NDEBUG
-    assert(s->x >= 0 && s->x < g_grid_width);
-    assert(s->y >= 0 && s->y < g_grid_height);
-    assert(s->cell_type >= CELL_TYPE_free && s->cell_type <= CELL_TYPE_goal);
-    assert(s->exit_dir >= DIRECTION_north && s->exit_dir <= DIRECTION_none);
+    assert(cell_get_exit_dir(s) <= DIRECTION_none);
+    assert(cell_get_num_changes(s) <= 6);
+    assert(cell_get_field(s, CELL_STUCK_MASK, CELL_STUCK_SHIFT) <= 4);
 #endif
 }
 
+/** A cell is dirty if its state differs from the one `search_lp_init` would
+ * produce from `g_obstacle_plane` (only dirty cells need to be cloned). */
+static inline bool is_dirty_SearchCellState(struct SearchCellState const *s) {
+    return cell_get_num_changes(s) > 0;
+}
+
 // ========================= Message enums and structs =========================
 
 /** Types of messages in the search simulation */
 enum MESSAGE_TYPE {
-  MESSAGE_TYPE_agent_move,      /**< Agent moves to this cell */
-  MESSAGE_TYPE_cell_unavailable /**< Notification that a neighbor cell is unavailable */
+  MESSAGE_TYPE_agent_move,       /**< Agent moves to this cell */
+  MESSAGE_TYPE_cell_unavailable, /**< Notification that a neighbor cell is unavailable */
+  MESSAGE_TYPE_branch_end,       /**< Sent to itself by the cell where the agent stopped, once every event of the branch is over */
+  MESSAGE_TYPE_agent_bounce,     /**< The agent was sent to a visited cell, and comes back to pick another way (only when carrying visited cells) */
+  MESSAGE_TYPE_resume            /**< Sent to itself by the first LP of PE 0 when resuming branches from disk, so that a GVT hook starts them */
 };
 
-/** Message data for search simulation events */
+/** Cells around the agent that its branch has visited, carried by the agent
+ * when cells are not notified (see `search_model_config`). It is a window of
+ * AGENT_TRAIL_SIZE x AGENT_TRAIL_SIZE cells with (x0, y0) as its top-left
+ * cell, one bit per cell in row-major order. Cells outside of it are unknown
+ * and read as not visited. Invariants:
+ * - the cell the agent is sent to lies in the window, away from its border
+ */
+#define AGENT_TRAIL_SIZE 8
+struct AgentTrail {
+  int32_t x0, y0;
+  uint64_t visited;
+};
+
+/** Whether the trail may be carried to the cell (x, y) */
+static inline bool is_valid_AgentTrail(struct AgentTrail const *trail, int x, int y) {
+    int const col = x - trail->x0;
+    int const row = y - trail->y0;
+    return col > 0 && col < AGENT_TRAIL_SIZE - 1 && row > 0 && row < AGENT_TRAIL_SIZE - 1;
+}
+
+static inline void assert_valid_AgentTrail(struct AgentTrail const *trail, int x, int y) {
+#ifndef NDEBUG
+    assert(x - trail->x0 > 0 && x - trail->x0 < AGENT_TRAIL_SIZE - 1);
+    assert(y - trail->y0 > 0 && y - trail->y0 < AGENT_TRAIL_SIZE - 1);
+#endif
+}
+
+/** Whether the agent carries the cells it visited (see `search_model_config`) */
+bool search_model_carries_visited(void);
+
+/** Message data for search simulation events. The trail is only part of
+ * the message when carrying visited cells, otherwise events are allocated
+ * without it (see `search_message_size`), so it has to stay last */
 struct SearchMessage {
   enum MESSAGE_TYPE type;
+  enum DIRECTION from_dir;     /**< Direction the notification (or the agent) came from. Only for cell_unavailable, agent_move and agent_bounce */
   tw_lpid sender;
-
-  union {
-    struct { // message type = cell_unavailable
-      enum DIRECTION from_dir;     /**< Direction the notification came from */
-    };
-  };
+  struct AgentTrail trail;     /**< Only for agent_move and agent_bounce, when carrying visited cells */
 };
 
-static inline bool is_valid_SearchMessage(struct SearchMessage *msg) {
-    if (msg->type != MESSAGE_TYPE_agent_move && msg->type != MESSAGE_TYPE_cell_unavailable) {
+/** Size of the data of an event: 16 bytes, or 32 with the trail when carrying
+ * visited cells */
+size_t search_message_size(void);
+
+/** Checks a message received by `lp`. The agent is sent to the cell of `lp`,
+ * so that is where its trail (if carried) must be centered */
+static inline bool is_valid_SearchMessage(struct SearchMessage *msg, tw_lp const *lp) {
+    if (msg->type != MESSAGE_TYPE_agent_move && msg->type != MESSAGE_TYPE_cell_unavailable
+        && msg->type != MESSAGE_TYPE_branch_end && msg->type != MESSAGE_TYPE_agent_bounce
+        && msg->type != MESSAGE_TYPE_resume) {
         return false;
     }
-    if (msg->type == MESSAGE_TYPE_agent_move) {
-        return msg->from_dir >= DIRECTION_north && msg->from_dir <= DIRECTION_none;
+    if (msg->type == MESSAGE_TYPE_agent_move
+        && !(msg->from_dir >= DIRECTION_north && msg->from_dir <= DIRECTION_none)) {
+        return false;
+    }
+    if ((msg->type == MESSAGE_TYPE_agent_move || msg->type == MESSAGE_TYPE_agent_bounce)
+        && search_model_carries_visited()) {
+        return is_valid_AgentTrail(&msg->trail, cell_x_of_lp(lp), cell_y_of_lp(lp));
     }
     return true;
 }
 
-static inline void assert_valid_SearchMessage(struct SearchMessage *msg) {
+static inline void assert_valid_SearchMessage(struct SearchMessage *msg, tw_lp const *lp) {
 #ifndef NDEBUG
-    assert(msg->type == MESSAGE_TYPE_agent_move || msg->type == MESSAGE_TYPE_cell_unavailable);
+    assert(msg->type == MESSAGE_TYPE_agent_move || msg->type == MESSAGE_TYPE_cell_unavailable
+           || msg->type == MESSAGE_TYPE_branch_end || msg->type == MESSAGE_TYPE_agent_bounce
+           || msg->type == MESSAGE_TYPE_resume);
     if (msg->type == MESSAGE_TYPE_agent_move) {
         assert(msg->from_dir >= DIRECTION_north && msg->from_dir <= DIRECTION_none);
     }
+    if ((msg->type == MESSAGE_TYPE_agent_move || msg->type == MESSAGE_TYPE_agent_bounce)
+        && search_model_carries_visited()) {
+        assert_valid_AgentTrail(&msg->trail, cell_x_of_lp(lp), cell_y_of_lp(lp));
+    }
 #endif
 }
 
+// ================================= Results and LP pages ===============================
+
+/** Allocates the (empty) page table of the results. Returns 0 on success. */
+int results_init(void);
+
+/** Frees all result pages and the page table. */
+void results_free(void);
+
+/** Forgets all results, so that the next branch starts with no visited cell. */
+void results_clear(void);
+
+void result_record(int x, int y, enum DIRECTION exit_dir);
+
+bool result_was_visited(int x, int y);
+
+enum DIRECTION result_exit_dir(int x, int y);
+
+/** Merges the results recorded by every rank of `comm` (each one holding the
+ * cells of its own tile) into the results of rank 0 of `comm`. Collective. */
+void results_gather(MPI_Comm comm);
+
+/** Local LPs are grouped in pages of LP_PAGE_SIZE consecutive LPs, and every
+ * page counts its dirty LPs (see `is_dirty_SearchCellState`). Anything that
+ * only cares about dirty LPs (cloning, resetting, collecting results) skips
+ * clean pages whole. */
+#define LP_PAGE_SIZE 1024
+
+/** Allocates the dirty counters of `nlp` local LPs. Returns 0 on success. */
+int search_lp_pages_init(size_t nlp);
+
+void search_lp_pages_free(void);
+
+size_t search_lp_num_pages(void);
+
+bool search_lp_page_is_dirty(size_t page);
+
+/** Number of dirty local LPs (the sum of the counters of all pages) */
+size_t search_lp_num_dirty(void);
+
+/** One past the last local LP of a page */
+static inline tw_lpid search_lp_page_end(size_t page) {
+    tw_lpid const end = (page + 1) * LP_PAGE_SIZE;
+    return end < g_tw_nlp ? end : g_tw_nlp;
+}
+
 // ================================= LP function declarations ===============================
 
 /** Cell initialization. */
 void search_lp_init(struct SearchCellState *s, struct tw_lp *lp);
 
+/** Sets the cell to its initial state (as defined by `g_obstacle_plane`) without scheduling any event. */
+void search_lp_reset_state(struct SearchCellState *s, struct tw_lp *lp);
+
+/** Overwrites the state of the cell (e.g., with one received in a clone). */
+void search_lp_restore_state(struct SearchCellState *s, struct tw_lp *lp, struct SearchCellState const *saved);
+
 /** Forward event handler. */
 void search_lp_event_handler(
         struct SearchCellState *s,
@@ -148,10 +460,22 @@ void search_lp_event_commit(
         struct SearchMessage *in_msg,
         struct tw_lp *lp);
 
-/** Cell finalization. */
+/** Cell finalization. Records the cell in the results if it was visited. */
 void search_lp_final(struct SearchCellState *s, struct tw_lp *lp);
 
-/** Exporting function to the director to schedule agent movement, to choose a path */
-void send_agent_move(tw_lp *lp, int x, int y, enum DIRECTION direction, double at);
+/** Chooses how the agent learns which neighbours are taken. By default every
+ * cell the agent leaves notifies its free neighbours (`cell_unavailable`).
+ * With `carry_visited`, the agent carries the cells around it that it has
+ * visited (`struct AgentTrail`) and no notification is sent. Must be called
+ * before the simulation starts. */
+void search_model_config(bool carry_visited);
+
+/** Exporting function to the director to schedule agent movement, to choose
+ * a path. `trail` is the trail the agent brought to (x, y) (only used when
+ * carrying visited cells). */
+void send_agent_move(tw_lp *lp, int x, int y, enum DIRECTION direction, double at, struct AgentTrail const *trail);
+
+/** Places the agent on the cell of `lp` (the start of a query) after a small delay */
+void send_agent_start(tw_lp *lp);
 
 #endif /* SEARCH_STATE_H */
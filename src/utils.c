@@ -1,6 +1,8 @@
 #include "utils.h"
 #include <mpi.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
 
@@ -19,3 +21,40 @@ void check_folder(char const * const path) {
         }
     }
 }
+
+int write_rank_ordered_file(MPI_Comm comm, char const *filename, char const *header,
+                            char const *data, size_t size, uint64_t *offset) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (size > INT_MAX) {
+        fprintf(stderr, "Error: Rank %d cannot write %zu bytes to '%s' at once\n", rank, size, filename);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    // The data of every rank follows the data of the ranks before it
+    uint64_t const my_size = size;
+    uint64_t my_offset = 0;
+    MPI_Exscan(&my_size, &my_offset, 1, MPI_UINT64_T, MPI_SUM, comm);
+    if (rank == 0) {
+        my_offset = 0;
+    }
+    my_offset += strlen(header);
+    if (offset) {
+        *offset = my_offset;
+    }
+
+    MPI_File fh;
+    if (MPI_File_open(comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        if (rank == 0) {
+            fprintf(stderr, "Error: Cannot create '%s'\n", filename);
+        }
+        return -1;
+    }
+    MPI_File_set_size(fh, 0);
+    if (rank == 0) {
+        MPI_File_write_at(fh, 0, header, (int) strlen(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_write_at_all(fh, (MPI_Offset) my_offset, data, (int) size, MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+    return 0;
+}
@@ -5,7 +5,18 @@
  * Utilities that don't rely on ROSS.
  */
 
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+
 /** Check and create directory. */
 void check_folder(char const * const path);
 
+/** Writes `header` (from rank 0) followed by the `size` bytes of `data` of
+ * every rank of `comm`, in rank order, to `filename` with collective MPI-IO.
+ * The file is truncated first. If `offset` is not NULL, it gets where the data
+ * of this rank starts in the file. Returns 0 on success. Collective. */
+int write_rank_ordered_file(MPI_Comm comm, char const *filename, char const *header,
+                            char const *data, size_t size, uint64_t *offset);
+
 #endif /* end of include guard */